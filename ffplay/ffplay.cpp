@@ -15,6 +15,17 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 #include <limits.h>
 #include <signal.h>
 #include <stdint.h>
+#include <atomic>
+#include <new>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_GAIN 1
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#define HAVE_NEON_GAIN 1
+#include <arm_neon.h>
+#endif
 
 #ifdef BUILD_AS_GUI
 #include "imgui.h"
@@ -40,6 +51,8 @@ extern "C" {
 #include "libavutil/samplefmt.h"
 #include "libavutil/time.h"
 #include "libavutil/bprint.h"
+#include "libavutil/cpu.h"
+#include "libavutil/imgutils.h"
 #include "libavformat/avformat.h"
 #include "libavdevice/avdevice.h"
 #include "libswscale/swscale.h"
@@ -78,7 +91,15 @@ extern "C" {
 
 #ifdef _WIN32
 #include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 #endif
+#include <sys/stat.h>
 
 // =============================================================================
 //                              Macros & Global Variables
@@ -88,7 +109,14 @@ const char program_name[] = "ffplay";
 const int program_birth_year = 2003;
 
 #define MAX_QUEUE_SIZE (15 * 1024 * 1024)
+/* number of entries in a packet queue ring, must be a power of two */
+#define PACKET_QUEUE_SIZE 4096
 #define MIN_FRAMES 25
+/* once asleep on full queues, read_thread is woken again when a queue drains
+   to this many packets or half a second, see packet_queue_low() */
+#define LOW_WATER_FRAMES (MIN_FRAMES / 2)
+/* and when all the queues together drain to this many bytes */
+#define LOW_WATER_SIZE (MAX_QUEUE_SIZE / 2)
 #define EXTERNAL_CLOCK_MIN_FRAMES 2
 #define EXTERNAL_CLOCK_MAX_FRAMES 10
 
@@ -100,6 +128,48 @@ const int program_birth_year = 2003;
 /* Step size for volume control in dB */
 #define SDL_VOLUME_STEP (0.75)
 
+/* playback rate range, atempo handles down to 0.5; from SPEED_SKIP_NONREF
+   up the video decoder skips non-reference frames instead of decoding
+   pictures that would mostly be dropped late */
+#define SPEED_MIN 0.5
+#define SPEED_MAX 4.0
+#define SPEED_SKIP_NONREF 2.0
+
+/* -live_latency: the jitter buffer holds this many times the measured
+   interarrival jitter, within [LIVE_MIN_BUFFER, target latency] seconds */
+#define LIVE_JITTER_MULT 4.0
+#define LIVE_MIN_BUFFER 0.02
+/* audio tempo change per second of buffer error, at most LIVE_MAX_TEMPO_DELTA
+   away from 1 so that the time-stretch stays inaudible */
+#define LIVE_TEMPO_GAIN 0.5
+#define LIVE_MAX_TEMPO_DELTA 0.05
+/* buffer errors below this are left alone */
+#define LIVE_DEADBAND 0.01
+
+/* -autodegrade: every DEGRADE_WINDOW microseconds, the video decoder steps up
+   one level when more than DEGRADE_DROP_RATIO of its frames were dropped or
+   it spent more than DEGRADE_LOAD_HIGH of the time in the codec, and down one
+   after recover_windows windows without drops below DEGRADE_LOAD_LOW */
+#define DEGRADE_WINDOW 1000000
+#define DEGRADE_MIN_FRAMES 5
+#define DEGRADE_DROP_RATIO 0.05
+#define DEGRADE_LOAD_HIGH 0.85
+#define DEGRADE_LOAD_LOW 0.5
+#define DEGRADE_RECOVER_MIN 3
+#define DEGRADE_RECOVER_MAX 48
+
+/* catch-up: the video decoder drops disposable packets undecoded once its
+   pictures lag the master clock by CATCHUP_ENTER_LAG seconds, until the lag
+   is back under CATCHUP_EXIT_LAG */
+#define CATCHUP_ENTER_LAG 0.5
+#define CATCHUP_EXIT_LAG 0.1
+
+/* frames of audio a PcmRing can track at once, a power of two */
+#define PCM_RING_MARKS 256
+
+/* volume changes are ramped over this many seconds to avoid zipper noise */
+#define AUDIO_GAIN_RAMP 0.02
+
 /* no AV sync correction is done if below the minimum AV sync threshold */
 #define AV_SYNC_THRESHOLD_MIN 0.04
 /* AV sync correction is done if above the maximum AV sync threshold */
@@ -120,8 +190,15 @@ const int program_birth_year = 2003;
 /* we use about AUDIO_DIFF_AVG_NB A-V differences to make the average */
 #define AUDIO_DIFF_AVG_NB   20
 
-/* polls for possible required screen refresh at least this often, should be less than 1/fps */
-#define REFRESH_RATE 0.01
+/* upper bound for sleeping between refreshes while playing, the actual wakeups
+   are scheduled from the frame timing, SDL events and newly decoded pictures */
+#define REFRESH_RATE 0.1
+/* SDL_WaitEventTimeout() only has millisecond granularity, the last stretch
+   before a refresh deadline is slept with av_usleep() instead */
+#define REFRESH_EVENT_MARGIN 0.002
+
+/* we use about PRESENT_JITTER_AVG_NB presented frames to average the jitter */
+#define PRESENT_JITTER_AVG_NB 30
 
 /* NOTE: the size must be big enough to compensate the hardware audio buffersize size */
 /* TODO: We assume that a decoded and resampled frame fits into this buffer */
@@ -131,10 +208,32 @@ const int program_birth_year = 2003;
 
 #define USE_ONEPASS_SUBTITLE_RENDER 1
 
+/* read-ahead reads from the wrapped context in chunks of this size */
+#define READAHEAD_CHUNK_SIZE (64 * 1024)
+/* buffer size of the custom AVIOContexts the demuxer reads through */
+#define CUSTOM_IO_BUFFER_SIZE 32768
+
+/* a mapped input asks the OS to page in this much ahead of the read position */
+#define MMAP_WILLNEED_SIZE (8 * 1024 * 1024)
+
+/* keyframe index sidecar files are named after the input plus this suffix */
+#define KEYFRAME_INDEX_SUFFIX ".kfidx"
+#define KEYFRAME_INDEX_MAGIC "FFPLAYKI"
+
+/* streaming textures pictures are uploaded into ahead of their display, at most 32 */
+#define VIDEO_TEXTURE_RING 4
+
+/* samples plotted by the GUI performance overlay, one per refresh */
+#define PERF_HISTORY_SIZE 300
+
+/* spans kept per thread by -trace, a power of two; the oldest are overwritten */
+#define TRACE_BUFFER_SIZE (1 << 16)
+
+/* default frame queue depths, see -pictq, -sampq, -subpq and -frameq_ms */
 #define VIDEO_PICTURE_QUEUE_SIZE 3
 #define SUBPICTURE_QUEUE_SIZE 16
 #define SAMPLE_QUEUE_SIZE 9
-#define FRAME_QUEUE_SIZE FFMAX(SAMPLE_QUEUE_SIZE, FFMAX(VIDEO_PICTURE_QUEUE_SIZE, SUBPICTURE_QUEUE_SIZE))
+#define FRAME_QUEUE_MAX_SIZE 256
 
 // =============================================================================
 //                            Struct Definitions
@@ -145,17 +244,168 @@ typedef struct MyAVPacketList {
     int serial;
 } MyAVPacketList;
 
+/* Recycled empty AVPacket shells, drawn by the producer in packet_queue_put and
+ * handed back by the consumer once packet_queue_get moved the payload out. It is
+ * a single-producer/single-consumer ring too, running in the opposite direction. */
+typedef struct PacketPool {
+    AVPacket **shells;
+    std::atomic<unsigned> windex;   /* shells returned by the consumer */
+    std::atomic<unsigned> rindex;   /* shells drawn by the producer */
+    std::atomic<int64_t> hits;
+    std::atomic<int64_t> misses;
+} PacketPool;
+
+/* What read_thread sleeps on once it has nothing to do. Anyone changing the
+ * state it waits for (a consumer draining its queue or all queues together to
+ * low water, a seek, pause or abort request) calls read_wakeup_signal(), which
+ * only takes the mutex if read_thread is actually asleep. */
+typedef struct ReadWakeup {
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    std::atomic<int> sleeping;
+    std::atomic<int> bytes;         /* size of all the packet queues together */
+} ReadWakeup;
+
+/* Bounded single-producer/single-consumer packet ring. read_thread is the only
+ * producer and the decoder thread the only consumer, neither takes a lock unless
+ * the ring is full or empty and it has to sleep on cond. */
 typedef struct PacketQueue {
-    AVFifo *pkt_list;
-    int nb_packets;
-    int size;
-    int64_t duration;
-    int abort_request;
-    int serial;
+    MyAVPacketList *pkt_list;
+    std::atomic<unsigned> windex;   /* only advanced by the producer */
+    std::atomic<unsigned> rindex;   /* advanced by the consumer and packet_queue_flush */
+    std::atomic<int> nb_packets;
+    std::atomic<int> size;
+    std::atomic<int64_t> duration;
+    std::atomic<int> abort_request;
+    std::atomic<int> serial;        /* only modified with mutex held, read without */
+    std::atomic<int> nb_waiters;    /* threads sleeping on cond */
+    int64_t low_water_duration;     /* in stream time base, see packet_queue_low() */
+    ReadWakeup *continue_read;      /* woken when the consumer drains to low water */
+    int peak_nb_packets;            /* high-water marks, only written by the producer */
+    int peak_size;
+    PacketPool pool;
     SDL_mutex *mutex;
     SDL_cond *cond;
 } PacketQueue;
 
+/* Byte ring filled by a reader thread from the real input context, which the
+ * demuxer reads through a custom AVIOContext. The ring holds [buf_start,
+ * buf_end) of the file: up to window bytes ahead of the demuxer position pos,
+ * the rest is already consumed data kept around for short backward seeks. */
+typedef struct ReadAhead {
+    AVIOContext *src;               /* wrapped context, only used by the reader thread */
+    AVIOContext *pb;                /* what the demuxer reads from */
+    uint8_t *buf;
+    int buf_size;
+    int window;
+    int64_t buf_start;
+    int64_t buf_end;
+    int64_t pos;
+    int64_t file_size;
+    int generation;                 /* bumped when a seek drops the buffered range */
+    int eof;
+    int error;
+    int abort_request;
+    int64_t prefetched;             /* bytes read from src */
+    int64_t consumed;               /* bytes handed to the demuxer */
+    int seeks_reused;
+    int seeks_dropped;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    SDL_Thread *tid;
+} ReadAhead;
+
+/* A local file mapped into memory in one piece, read by the demuxer through a
+ * custom AVIOContext in direct mode, i.e. without read syscalls and without
+ * the intermediate AVIOContext buffer. The mapping is owned by an AVBufferRef
+ * that unmaps it on release, so it stays valid while anything refers to it. */
+typedef struct MappedInput {
+    AVBufferRef *map;
+    AVIOContext *pb;
+    int64_t pos;
+    int64_t willneed_end;           /* end of the range last passed to MADV_WILLNEED */
+} MappedInput;
+
+typedef struct KeyframeIndexEntry {
+    int64_t ts;                     /* in AV_TIME_BASE units, same reference as seek_pos */
+    int64_t pos;                    /* byte offset of the keyframe packet */
+} KeyframeIndexEntry;
+
+/* Keyframe timestamp -> byte offset map of one video stream, either loaded from
+ * a sidecar file or built by a background thread scanning the input once. The
+ * entries are only used once complete is set. */
+typedef struct KeyframeIndex {
+    char *url;
+    char *sidecar;
+    const AVInputFormat *iformat;
+    AVDictionary *format_opts;      /* options the player opened the input with */
+    int64_t file_size;
+    int64_t file_mtime;
+    int stream_index;
+    KeyframeIndexEntry *entries;
+    int nb_entries;
+    int nb_allocated;
+    std::atomic<int> complete;
+    std::atomic<int> abort_request;
+    SDL_Thread *tid;
+} KeyframeIndex;
+
+/* Decoded frames of one GOP sorted by pts, covering [key_pts, end_pts) in the
+ * video stream time base. end_pts is the next keyframe, INT64_MAX at EOF. A GOP
+ * too large for the cache only keeps a window of it ending at the frame asked
+ * for, key_pts is then the first frame of the window. */
+typedef struct GopCacheEntry {
+    int64_t key_pts;
+    int64_t end_pts;
+    AVFrame **frames;
+    int nb_frames;
+    int nb_allocated;
+    size_t bytes;
+    int64_t last_used;
+} GopCacheEntry;
+
+/* Bounded cache of decoded GOPs for reverse playback and backward stepping. A
+ * thread of its own demuxes and decodes the video stream on a separate context,
+ * serving the GOP video_thread waits for first and prefetching the GOP before
+ * the one being played back otherwise. The least recently used GOPs are evicted
+ * once the cache grows above max_bytes. */
+typedef struct GopCache {
+    GopCacheEntry *gops;
+    int nb_gops;
+    size_t bytes;
+    size_t max_bytes;
+    int64_t use_clock;
+    int64_t start_pts;              /* nothing can be decoded before this */
+    int64_t request_pts;            /* GOP containing this is waited for, AV_NOPTS_VALUE if none */
+    int64_t prefetch_pts;           /* GOP containing this is wanted next, AV_NOPTS_VALUE if none */
+    int nb_windowed;                /* GOPs only partly kept, see gop_cache_decode() */
+    std::atomic<int> abort_request;
+    char *url;
+    const AVInputFormat *iformat;
+    int stream_index;
+    char *codec_name;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    SDL_Thread *tid;
+} GopCache;
+
+/* Pool of video frame buffers handed to the decoder through get_buffer2, so
+ * the picture memory is recycled across frames instead of being allocated and
+ * freed per frame. Every buffer holds all the planes of one picture at the
+ * layout computed for the current format and size; the pool is rebuilt when
+ * either changes, buffers still in flight keep the old one alive. */
+typedef struct FramePool {
+    AVBufferPool *pool;
+    int format;
+    int width, height;
+    int linesize[4];
+    size_t offset[4];
+    size_t size;
+    int64_t nb_buffers;             /* buffers allocated by the pool */
+    int64_t nb_frames;              /* buffers handed out */
+    SDL_mutex *mutex;               /* get_buffer2 runs on the frame threads */
+} FramePool;
+
 typedef struct AudioParams {
     int freq;
     AVChannelLayout ch_layout;
@@ -171,7 +421,7 @@ typedef struct Clock {
     double speed;
     int serial;           /* clock is based on a packet with this serial */
     int paused;
-    int *queue_serial;    /* pointer to the current packet queue serial, used for obsolete clock detection */
+    const std::atomic<int> *queue_serial; /* pointer to the current packet queue serial, used for obsolete clock detection, NULL if none */
 } Clock;
 
 typedef struct FrameData {
@@ -191,22 +441,132 @@ typedef struct Frame {
     int format;
     AVRational sar;
     int uploaded;
+    int texture;          /* slot in the video texture ring once uploaded */
     int flip_v;
 } Frame;
 
+/* Where the samples of one decoded frame end in a PcmRing, and the audio clock
+ * at that point. */
+typedef struct PcmMark {
+    unsigned end;
+    double clock;
+    double tempo;                       /* stream seconds per second of output */
+    int serial;
+} PcmMark;
+
+/* Single-producer/single-consumer ring of output format PCM between the audio
+ * render thread and the SDL audio callback. Byte and mark indices run freely
+ * and are masked with size - 1 and PCM_RING_MARKS - 1. The callback never
+ * locks nor waits: it copies what is there and counts an underrun otherwise. */
+typedef struct PcmRing {
+    uint8_t *data;
+    unsigned size;                      /* bytes, a power of two */
+    std::atomic<unsigned> windex;       /* only advanced by the render thread */
+    std::atomic<unsigned> rindex;       /* only advanced by the callback */
+    PcmMark marks[PCM_RING_MARKS];
+    std::atomic<unsigned> mark_windex;
+    std::atomic<unsigned> mark_rindex;
+    PcmMark last_mark;                  /* callback side: the last mark played past */
+} PcmRing;
+
+/* Steps the video decoder takes, cheapest in quality first. */
+enum DegradeLevel {
+    DEGRADE_NONE,
+    DEGRADE_LOOP_FILTER_NONREF,         /* skip_loop_filter=nonref */
+    DEGRADE_LOOP_FILTER_ALL,            /* skip_loop_filter=all */
+    DEGRADE_SKIP_NONREF,                /* skip_frame=nonref */
+    DEGRADE_FAST,                       /* flags2=+fast */
+};
+
+/* Closed loop over the video decoder's frame drops and codec time, only run
+ * by the video decoder thread, which owns the codec context. */
+typedef struct Degrade {
+    int level;
+    int max_level;                      /* 0 when disabled */
+    int64_t window_start;
+    int64_t window_frames;              /* viddec.nb_frames at window_start */
+    int64_t window_codec_time;          /* viddec.codec_time at window_start */
+    int window_drops;                   /* frame drops at window_start */
+    int calm_windows;                   /* consecutive windows with headroom */
+    int recover_windows;                /* needed to step down, doubles on each relapse */
+    int64_t last_down;                  /* when the level was last lowered */
+    int changes;
+    int peak;
+    enum AVDiscard skip_loop_filter;    /* codec settings without degradation */
+    int flags2;
+} Degrade;
+
+/* Single-producer/single-consumer frame ring. The decoder thread owns windex,
+ * the display (or audio callback) owns rindex and rindex_shown. The indices run
+ * freely and are masked with capacity - 1; mutex/cond are only used to sleep
+ * when the queue is full or has nothing readable. */
 typedef struct FrameQueue {
-    Frame queue[FRAME_QUEUE_SIZE];
-    int rindex;
-    int windex;
-    int size;
+    Frame *queue;                   /* capacity slots */
+    std::atomic<unsigned> rindex;
+    std::atomic<unsigned> windex;
+    int capacity;                   /* power of two >= max_size */
     int max_size;
     int keep_last;
     int rindex_shown;
+    int peak_size;                  /* high-water mark, only written by the producer */
+    std::atomic<int> nb_waiters;    /* threads sleeping on cond */
     SDL_mutex *mutex;
     SDL_cond *cond;
     PacketQueue *pktq;
 } FrameQueue;
 
+typedef struct TraceEvent {
+    const char *name;               /* a string literal */
+    int64_t start;                  /* av_gettime_relative() */
+    int64_t duration;
+} TraceEvent;
+
+/* Spans recorded by one thread. Only the owning thread writes, and publishes
+ * each event by advancing nb_events; the buffers are chained on trace_buffers
+ * and read back once the other threads have exited. */
+typedef struct TraceBuffer {
+    TraceEvent events[TRACE_BUFFER_SIZE];
+    std::atomic<unsigned> nb_events;
+    SDL_threadID tid;
+    const char *thread_name;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+enum PerfSeries {
+    PERF_AUDIOQ,
+    PERF_VIDEOQ,
+    PERF_SUBTITLEQ,
+    PERF_PICTQ,
+    PERF_SAMPQ,
+    PERF_AV_DRIFT,
+    PERF_DECODE_TIME,
+    PERF_UPLOAD_TIME,
+    PERF_PRESENT_TIME,
+    PERF_PRESENT_JITTER,
+    PERF_DROPS_EARLY,
+    PERF_DROPS_LATE,
+    PERF_NB
+};
+
+/* Rings of the metrics shown by the GUI overlay, sampled and read by the main
+ * thread only. index is the next slot to write, i.e. the oldest sample. */
+typedef struct PerfHistory {
+    float values[PERF_NB][PERF_HISTORY_SIZE];
+    int index;
+    int last_drops_early;
+    int last_drops_late;
+} PerfHistory;
+
+/* threads whose CPU time -benchmark reports */
+enum BenchStage {
+    BENCH_STAGE_READ,
+    BENCH_STAGE_VIDEO,              /* decoding and filtering */
+    BENCH_STAGE_AUDIO,
+    BENCH_STAGE_VIDEO_SINK,
+    BENCH_STAGE_AUDIO_SINK,         /* conversion to the output format */
+    BENCH_STAGE_NB
+};
+
 enum {
     AV_SYNC_AUDIO_MASTER, /* default choice */
     AV_SYNC_VIDEO_MASTER,
@@ -220,7 +580,21 @@ typedef struct Decoder {
     int pkt_serial;
     int finished;
     int packet_pending;
-    SDL_cond *empty_queue_cond;
+    std::atomic<int64_t> seek_target; /* accurate seeking: frames ending before this are dropped, AV_TIME_BASE units */
+    std::atomic<int> seek_serial;     /* packet serial seek_target applies to, -1 if none; published after seek_target */
+    enum AVDiscard skip_frame;  /* skip_frame outside of accurate seeks */
+    std::atomic<enum AVDiscard> speed_skip_frame; /* raised at high playback rates, see speed_skip_frame() */
+    enum AVDiscard degrade_skip_frame; /* raised under load, see degrade_update() */
+    int64_t nb_frames;          /* frames returned by the codec */
+    int64_t codec_time;         /* total decode_time of those, in microseconds */
+    int nal_length_size;        /* H.264 only: 0 for Annex B, -1 for other codecs */
+    int catch_up;               /* dropping disposable packets, see decoder_set_catch_up() */
+    int64_t catch_up_start;
+    int64_t catch_up_time;      /* total time spent catching up, in microseconds */
+    int catch_ups;
+    int64_t catch_up_skipped;   /* packets dropped undecoded */
+    int64_t decode_time;        /* time spent in the codec since the last frame, in microseconds */
+    double frame_decode_time;   /* decode_time of the last frame returned, in seconds */
     int64_t start_pts;
     AVRational start_pts_tb;
     int64_t next_pts;
@@ -271,23 +645,45 @@ typedef struct VideoState {
     int audio_hw_buf_size;
     uint8_t *audio_buf;
     uint8_t *audio_buf1;
-    unsigned int audio_buf_size; /* in bytes */
     unsigned int audio_buf1_size;
-    int audio_buf_index; /* in bytes */
     int audio_write_buf_size;
     int audio_volume;
     int muted;
+    float audio_gain;                   /* gain applied to the last sample output, ramps towards the volume */
+    PcmRing pcm_ring;
+    SDL_Thread *audio_render_tid;
+    std::atomic<int> audio_render_abort;
+    int audio_underruns;                /* callbacks the ring could not fill while playing */
+    double audio_clock_tempo;           /* tempo of the frame audio_clock belongs to */
+    double audio_tempo;                 /* tempo the atempo filter runs at, 1 without one */
+    std::atomic<double> speed;          /* playback rate, scales the audio tempo and the video clock */
+    double tempo_out_origin;            /* output and stream time at the last tempo change, */
+    double tempo_stream_origin;         /* to map atempo's output pts back to stream time */
+
+    int live;                           /* -live_latency applies to this realtime input */
+    int live_stream;                    /* stream whose packet arrivals are measured */
+    int64_t live_last_arrival;
+    double live_last_ts;
+    std::atomic<double> live_newest_ts; /* newest timestamp received, in seconds; written by read_thread */
+    std::atomic<double> live_jitter;    /* RFC 3550 interarrival jitter, in seconds; written by read_thread */
+    double live_target;                 /* current jitter buffer target */
+    double live_buffered;               /* received but not yet played */
+    std::atomic<double> live_tempo;     /* tempo the controller asks for, read by audio_thread */
+    double live_g2g;                    /* glass-to-glass latency, NAN if the capture time is unknown */
+    double live_buffered_sum, live_g2g_sum;
+    int64_t live_buffered_nb, live_g2g_nb;
     struct AudioParams audio_src;
     struct AudioParams audio_filter_src;
     struct AudioParams audio_tgt;
     struct SwrContext *swr_ctx;
     int frame_drops_early;
     int frame_drops_late;
+    Degrade degrade;
 
     enum ShowMode {
         SHOW_MODE_NONE = -1, SHOW_MODE_VIDEO = 0, SHOW_MODE_WAVES, SHOW_MODE_RDFT, SHOW_MODE_NB
     } show_mode;
-    int16_t sample_array[SAMPLE_ARRAY_SIZE];
+    float sample_array[SAMPLE_ARRAY_SIZE];
     int sample_array_index;
     int last_i_start;
     AVTXContext *rdft;
@@ -299,7 +695,7 @@ typedef struct VideoState {
     double last_vis_time;
     SDL_Texture *vis_texture;
     SDL_Texture *sub_texture;
-    SDL_Texture *vid_texture;
+    SDL_Texture *vid_textures[VIDEO_TEXTURE_RING];  /* indexed by Frame.texture */
 
     int subtitle_stream;
     AVStream *subtitle_st;
@@ -328,7 +724,41 @@ typedef struct VideoState {
 
     int last_video_stream, last_audio_stream, last_subtitle_stream;
 
-    SDL_cond *continue_read_thread;
+    ReadWakeup continue_read_thread;
+    ReadAhead *readahead;
+    MappedInput *mapped_input;
+    KeyframeIndex *kf_index;
+
+    FramePool *frame_pool;
+
+    GopCache *gop_cache;
+    int reverse;                        /* video is played backwards from the GOP cache */
+    double reverse_pts;                 /* pts of the last picture queued in reverse */
+    std::atomic<double> reverse_seek_pts; /* where reverse playback resumes after a seek, NAN for byte seeks */
+
+    int64_t bench_start;                /* -benchmark wall clock span, in microseconds */
+    int64_t bench_end;
+    int64_t bench_cpu[BENCH_STAGE_NB];  /* CPU time of each stage, added as its threads exit */
+    int64_t bench_video_frames;
+    int64_t bench_audio_samples;
+    SDL_Thread *video_sink_tid;
+    SDL_Thread *audio_sink_tid;
+
+    std::atomic<int> refresh_wanted;    /* the refresh loop sleeps until the next picture is queued */
+    double present_target;              /* target time of the picture being presented, NAN if none */
+    double present_jitter_avg;          /* moving average of |present time - target time| */
+    double present_jitter_max;
+    double present_jitter_sum;
+    int64_t present_jitter_nb;
+    double present_jitter_last;
+    double upload_time;                 /* duration of the last texture upload */
+    double upload_time_sum;
+    int64_t upload_nb;
+    int64_t upload_ahead_nb;            /* uploads done before the picture was due */
+    double present_time;                /* duration of the last SDL_RenderPresent() */
+    double present_time_sum;
+    int64_t present_nb;
+    int sub_shown;                      /* GUI builds: sub_texture goes over the picture */
 } VideoState;
 
 // =============================================================================
@@ -369,6 +799,24 @@ static int exit_on_mousedown;
 static int loop = 1;
 static int framedrop = -1;
 static int infinite_buffer = -1;
+static int vsync = 1;
+static int use_mmap = 0;
+static int use_kf_index = 0;
+static int accurate_seek = 0;
+static int readahead_size = 0;
+static int readahead_window = 0;
+static int gop_cache_size = 256;
+static int frame_pool = 0;
+static int benchmark = 0;
+static int gain_bench = 0;
+static int live_latency = 0;
+static int autodegrade = 0;
+static float playback_speed = 1.0;
+static const char *trace_filename;
+static int video_picture_queue_size = VIDEO_PICTURE_QUEUE_SIZE;
+static int sample_queue_size = SAMPLE_QUEUE_SIZE;
+static int subpicture_queue_size = SUBPICTURE_QUEUE_SIZE;
+static int frame_queue_ms = 0;
 static enum VideoState::ShowMode show_mode = VideoState::SHOW_MODE_NONE;
 static const char *audio_codec_name;
 static const char *subtitle_codec_name;
@@ -389,12 +837,17 @@ static const char *hwaccel = NULL;
 /* current context */
 static int is_full_screen;
 static int64_t audio_callback_time;
+static int trace_enabled;
+static std::atomic<TraceBuffer *> trace_buffers;
+static thread_local TraceBuffer *trace_buffer;
 
+#define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
 #define FF_QUIT_EVENT    (SDL_USEREVENT + 2)
 
 static SDL_Window *window;
 static SDL_Renderer *renderer;
 static SDL_RendererInfo renderer_info = {0};
+static double vsync_period;     /* display refresh period if presenting is vsynced, 0 otherwise */
 static SDL_AudioDeviceID audio_dev;
 
 // static VkRenderer *vk_renderer;
@@ -422,6 +875,12 @@ static const struct TextureFormatEntry {
     { AV_PIX_FMT_YUV420P,        SDL_PIXELFORMAT_IYUV },
     { AV_PIX_FMT_YUYV422,        SDL_PIXELFORMAT_YUY2 },
     { AV_PIX_FMT_UYVY422,        SDL_PIXELFORMAT_UYVY },
+#if SDL_VERSION_ATLEAST(2,0,16)
+    { AV_PIX_FMT_NV12,           SDL_PIXELFORMAT_NV12 },
+    { AV_PIX_FMT_NV21,           SDL_PIXELFORMAT_NV21 },
+    /* SDL2 has no 10-bit YUV texture, P010 is narrowed into an NV12 one */
+    { AV_PIX_FMT_P010,           SDL_PIXELFORMAT_NV12 },
+#endif
 };
 
 static int dummy;
@@ -454,7 +913,7 @@ static void set_clock_at(Clock *c, double pts, int serial, double time)
 
 static double get_clock(Clock *c)
 {
-    if (*c->queue_serial != c->serial)
+    if (c->queue_serial && c->queue_serial->load(std::memory_order_acquire) != c->serial)
         return NAN;
     if (c->paused) {
         return c->pts;
@@ -476,7 +935,7 @@ static void set_clock_speed(Clock *c, double speed)
     c->speed = speed;
 }
 
-static void init_clock(Clock *c, int *queue_serial)
+static void init_clock(Clock *c, const std::atomic<int> *queue_serial)
 {
     c->speed = 1.0;
     c->paused = 0;
@@ -493,6 +952,8 @@ static void sync_clock_to_slave(Clock *c, Clock *slave)
 }
 
 static int get_master_sync_type(VideoState *is) {
+    if (is->reverse)
+        return AV_SYNC_VIDEO_MASTER;
     if (is->av_sync_type == AV_SYNC_VIDEO_MASTER) {
         if (is->video_st)
             return AV_SYNC_VIDEO_MASTER;
@@ -527,21 +988,171 @@ static double get_master_clock(VideoState *is)
     return val;
 }
 
+/* the drift correction is relative to the playback rate */
 static void check_external_clock_speed(VideoState *is) {
+   double nominal = is->speed.load(std::memory_order_relaxed);
    if (is->video_stream >= 0 && is->videoq.nb_packets <= EXTERNAL_CLOCK_MIN_FRAMES ||
        is->audio_stream >= 0 && is->audioq.nb_packets <= EXTERNAL_CLOCK_MIN_FRAMES) {
-       set_clock_speed(&is->extclk, FFMAX(EXTERNAL_CLOCK_SPEED_MIN, is->extclk.speed - EXTERNAL_CLOCK_SPEED_STEP));
+       set_clock_speed(&is->extclk, FFMAX(EXTERNAL_CLOCK_SPEED_MIN * nominal, is->extclk.speed - EXTERNAL_CLOCK_SPEED_STEP));
    } else if ((is->video_stream < 0 || is->videoq.nb_packets > EXTERNAL_CLOCK_MAX_FRAMES) &&
               (is->audio_stream < 0 || is->audioq.nb_packets > EXTERNAL_CLOCK_MAX_FRAMES)) {
-       set_clock_speed(&is->extclk, FFMIN(EXTERNAL_CLOCK_SPEED_MAX, is->extclk.speed + EXTERNAL_CLOCK_SPEED_STEP));
+       set_clock_speed(&is->extclk, FFMIN(EXTERNAL_CLOCK_SPEED_MAX * nominal, is->extclk.speed + EXTERNAL_CLOCK_SPEED_STEP));
    } else {
        double speed = is->extclk.speed;
-       if (speed != 1.0)
-           set_clock_speed(&is->extclk, speed + EXTERNAL_CLOCK_SPEED_STEP * (1.0 - speed) / fabs(1.0 - speed));
+       if (speed != nominal)
+           set_clock_speed(&is->extclk, speed < nominal ? FFMIN(nominal, speed + EXTERNAL_CLOCK_SPEED_STEP) :
+                                                          FFMAX(nominal, speed - EXTERNAL_CLOCK_SPEED_STEP));
    }
 }
 
 
+//              ##########################################
+//                          Trace Functions
+//              ##########################################
+
+/* the calling thread's span buffer, created and chained on first use */
+static TraceBuffer *trace_get_buffer(void)
+{
+    TraceBuffer *tb = trace_buffer;
+
+    if (!tb) {
+        tb = static_cast<TraceBuffer *>(av_mallocz(sizeof(*tb)));
+        if (!tb)
+            return NULL;
+        tb->tid = SDL_ThreadID();
+        tb->next = trace_buffers.load(std::memory_order_relaxed);
+        while (!trace_buffers.compare_exchange_weak(tb->next, tb, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        trace_buffer = tb;
+    }
+    return tb;
+}
+
+static void trace_set_thread_name(const char *name)
+{
+    TraceBuffer *tb;
+
+    if (trace_enabled && (tb = trace_get_buffer()))
+        tb->thread_name = name;
+}
+
+static void trace_record(const char *name, int64_t start)
+{
+    TraceBuffer *tb = trace_get_buffer();
+    TraceEvent *ev;
+    unsigned n;
+
+    if (!tb)
+        return;
+    n = tb->nb_events.load(std::memory_order_relaxed);
+    ev = &tb->events[n & (TRACE_BUFFER_SIZE - 1)];
+    ev->name = name;
+    ev->start = start;
+    ev->duration = av_gettime_relative() - start;
+    tb->nb_events.store(n + 1, std::memory_order_release);
+}
+
+/* open a span, 0 when tracing is off so that trace_end() costs one test */
+static inline int64_t trace_begin(void)
+{
+    return trace_enabled ? av_gettime_relative() : 0;
+}
+
+static inline void trace_end(const char *name, int64_t start)
+{
+    if (start)
+        trace_record(name, start);
+}
+
+/* write all spans to trace_filename in the Chrome trace-event format, which
+   chrome://tracing and Perfetto load, and stop tracing; called once the
+   traced threads have exited */
+static void trace_export(void)
+{
+    TraceBuffer *tb = trace_buffers.exchange(NULL, std::memory_order_acquire);
+    const char *sep = "";
+    FILE *f = NULL;
+
+    if (!trace_enabled)
+        return;
+    trace_enabled = 0;
+    trace_buffer = NULL;
+    if (!(f = fopen(trace_filename, "w")))
+        av_log(NULL, AV_LOG_ERROR, "Could not write trace %s\n", trace_filename);
+    else
+        fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    while (tb) {
+        TraceBuffer *next = tb->next;
+        unsigned n = tb->nb_events.load(std::memory_order_acquire);
+        unsigned i = n > TRACE_BUFFER_SIZE ? n - TRACE_BUFFER_SIZE : 0;
+
+        if (f && tb->thread_name) {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                    sep, (unsigned long)tb->tid, tb->thread_name);
+            sep = ",\n";
+        }
+        if (i)
+            av_log(NULL, AV_LOG_WARNING, "Trace of thread %lu lost its %u oldest spans\n", (unsigned long)tb->tid, i);
+        for (; f && i != n; i++) {
+            TraceEvent *ev = &tb->events[i & (TRACE_BUFFER_SIZE - 1)];
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%" PRId64 ",\"dur\":%" PRId64 "}",
+                    sep, ev->name, (unsigned long)tb->tid, ev->start, ev->duration);
+            sep = ",\n";
+        }
+        av_free(tb);
+        tb = next;
+    }
+    if (f) {
+        fprintf(f, "\n]}\n");
+        if (fclose(f))
+            av_log(NULL, AV_LOG_ERROR, "Could not write trace %s\n", trace_filename);
+        else
+            av_log(NULL, AV_LOG_INFO, "Wrote trace %s\n", trace_filename);
+    }
+}
+
+
+//              ##########################################
+//                      Read Thread Wakeup Functions
+//              ##########################################
+
+static int read_wakeup_init(ReadWakeup *w)
+{
+    w->sleeping = 0;
+    w->bytes = 0;
+    if (!(w->mutex = SDL_CreateMutex())) {
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+        return AVERROR(ENOMEM);
+    }
+    if (!(w->cond = SDL_CreateCond())) {
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+static void read_wakeup_destroy(ReadWakeup *w)
+{
+    SDL_DestroyMutex(w->mutex);
+    SDL_DestroyCond(w->cond);
+}
+
+/* publish a state change read_thread may be waiting for; the change itself must
+ * be stored before the call */
+static void read_wakeup_signal(ReadWakeup *w)
+{
+    /* pairs with the fence in read_thread_wait(): either read_thread sees the
+     * new state when it re-checks, or we see it asleep */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (w->sleeping.load(std::memory_order_relaxed)) {
+        SDL_LockMutex(w->mutex);
+        SDL_CondSignal(w->cond);
+        SDL_UnlockMutex(w->mutex);
+    }
+}
+
+
 //              ##########################################
 //                         Toggle Functions
 //              ##########################################
@@ -558,6 +1169,16 @@ static void stream_toggle_pause(VideoState *is)
     }
     set_clock(&is->extclk, get_clock(&is->extclk), is->extclk.serial);
     is->paused = is->audclk.paused = is->vidclk.paused = is->extclk.paused = !is->paused;
+    read_wakeup_signal(&is->continue_read_thread);
+    /* the refresh loop sleeps without a timeout while paused; read_thread
+       resumes playback to step after a seek and has to wake it */
+    if (!is->paused) {
+        SDL_Event event;
+
+        event.type = FF_REFRESH_EVENT;
+        event.user.data1 = is;
+        SDL_PushEvent(&event);
+    }
 }
 
 
@@ -597,54 +1218,221 @@ static void update_volume(VideoState *is, int sign, double step)
     is->audio_volume = av_clip(is->audio_volume == new_volume ? (is->audio_volume + sign) : new_volume, 0, SDL_MIX_MAXVOLUME);
 }
 
+static enum AVDiscard speed_skip_frame(double speed)
+{
+    return speed >= SPEED_SKIP_NONREF ? AVDISCARD_NONREF : AVDISCARD_NONE;
+}
+
+/* change the playback rate: audio_thread picks up the new tempo, the video
+   and external clocks run at the rate and video_refresh shortens the frame
+   delays accordingly. Live inputs always play at the live edge. */
+static void set_playback_speed(VideoState *is, double speed)
+{
+    speed = av_clipd(speed, SPEED_MIN, SPEED_MAX);
+    if (is->live || speed == is->speed.load(std::memory_order_relaxed))
+        return;
+    is->speed.store(speed, std::memory_order_relaxed);
+    set_clock_speed(&is->vidclk, speed);
+    set_clock_speed(&is->extclk, speed);
+    is->viddec.speed_skip_frame.store(speed_skip_frame(speed), std::memory_order_relaxed);
+    av_log(NULL, AV_LOG_VERBOSE, "Playback speed %.2fx\n", speed);
+}
+
+static void step_playback_speed(VideoState *is, int sign)
+{
+    static const double speeds[] = { 0.5, 0.75, 1.0, 1.25, 1.5, 2.0, 3.0, 4.0 };
+    double speed = is->speed.load(std::memory_order_relaxed);
+    int i;
+
+    if (sign > 0) {
+        for (i = 0; i < (int)FF_ARRAY_ELEMS(speeds) - 1 && speeds[i] <= speed; i++)
+            ;
+    } else {
+        for (i = (int)FF_ARRAY_ELEMS(speeds) - 1; i > 0 && speeds[i] >= speed; i--)
+            ;
+    }
+    set_playback_speed(is, speeds[i]);
+}
+
 
 
 //              ##########################################
 //                          Packet Queue Functions
 //              ##########################################
 
-static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
+static int packet_pool_init(PacketPool *p)
 {
-    MyAVPacketList pkt1;
-    int ret;
+    p->shells = static_cast<AVPacket**>(av_calloc(PACKET_QUEUE_SIZE, sizeof(*p->shells)));
+    if (!p->shells)
+        return AVERROR(ENOMEM);
+    p->windex = 0;
+    p->rindex = 0;
+    p->hits = 0;
+    p->misses = 0;
+    return 0;
+}
 
-    if (q->abort_request)
-       return -1;
+static void packet_pool_destroy(PacketPool *p)
+{
+    unsigned rindex = p->rindex;
 
+    for (; rindex != p->windex; rindex++)
+        av_packet_free(&p->shells[rindex & (PACKET_QUEUE_SIZE - 1)]);
+    p->rindex = rindex;
+    av_freep(&p->shells);
+}
 
-    pkt1.pkt = pkt;
-    pkt1.serial = q->serial;
+/* get an empty packet, recycled from the consumer if possible (producer side) */
+static AVPacket *packet_pool_get(PacketPool *p)
+{
+    unsigned rindex = p->rindex.load(std::memory_order_relaxed);
 
-    ret = av_fifo_write(q->pkt_list, &pkt1, 1);
-    if (ret < 0)
-        return ret;
-    q->nb_packets++;
-    q->size += pkt1.pkt->size + sizeof(pkt1);
-    q->duration += pkt1.pkt->duration;
+    if (rindex != p->windex.load(std::memory_order_acquire)) {
+        AVPacket *pkt = p->shells[rindex & (PACKET_QUEUE_SIZE - 1)];
+        p->rindex.store(rindex + 1, std::memory_order_release);
+        p->hits.fetch_add(1, std::memory_order_relaxed);
+        return pkt;
+    }
+    p->misses.fetch_add(1, std::memory_order_relaxed);
+    return av_packet_alloc();
+}
+
+/* hand an empty packet back to the producer (consumer side) */
+static void packet_pool_put(PacketPool *p, AVPacket *pkt)
+{
+    unsigned windex = p->windex.load(std::memory_order_relaxed);
+
+    if (windex - p->rindex.load(std::memory_order_acquire) >= PACKET_QUEUE_SIZE) {
+        av_packet_free(&pkt);
+        return;
+    }
+    p->shells[windex & (PACKET_QUEUE_SIZE - 1)] = pkt;
+    p->windex.store(windex + 1, std::memory_order_release);
+}
+
+static inline int packet_queue_full(PacketQueue *q)
+{
+    return q->windex.load(std::memory_order_acquire) - q->rindex.load(std::memory_order_acquire) >= PACKET_QUEUE_SIZE;
+}
+
+static inline int packet_queue_empty(PacketQueue *q)
+{
+    return q->windex.load(std::memory_order_acquire) == q->rindex.load(std::memory_order_acquire);
+}
+
+/* low water mark, half of what stream_has_enough_packets() asks for */
+static inline int packet_queue_low(PacketQueue *q)
+{
+    return q->nb_packets <= LOW_WATER_FRAMES ||
+           (q->duration && q->duration <= q->low_water_duration);
+}
+
+/* sleep until the ring has room (for_space) or holds a packet, until the queue
+ * is flushed past serial, or until abort */
+static void packet_queue_wait(PacketQueue *q, int for_space, int serial)
+{
+    SDL_LockMutex(q->mutex);
+    q->nb_waiters.fetch_add(1, std::memory_order_relaxed);
+    /* pairs with the fence in packet_queue_wake(): either we see the index
+     * the other side just published, or it sees us as a waiter */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!q->abort_request && q->serial.load(std::memory_order_relaxed) == serial &&
+           (for_space ? packet_queue_full(q) : packet_queue_empty(q)))
+        SDL_CondWait(q->cond, q->mutex);
+    q->nb_waiters.fetch_sub(1, std::memory_order_relaxed);
+    SDL_UnlockMutex(q->mutex);
+}
+
+static void packet_queue_wake(PacketQueue *q)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (q->nb_waiters.load(std::memory_order_relaxed)) {
+        SDL_LockMutex(q->mutex);
+        SDL_CondSignal(q->cond);
+        SDL_UnlockMutex(q->mutex);
+    }
+}
+
+/* detach the oldest entry, return 0 if the ring is empty. The read index is
+ * advanced with a CAS so that packet_queue_flush can drain the ring while the
+ * consumer is running. */
+static int packet_queue_pop(PacketQueue *q, MyAVPacketList *pkt1)
+{
+    unsigned rindex = q->rindex.load(std::memory_order_relaxed);
+    int bytes;
+
+    do {
+        if (rindex == q->windex.load(std::memory_order_acquire))
+            return 0;
+        *pkt1 = q->pkt_list[rindex & (PACKET_QUEUE_SIZE - 1)];
+    } while (!q->rindex.compare_exchange_weak(rindex, rindex + 1,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed));
+
+    q->nb_packets.fetch_sub(1, std::memory_order_relaxed);
+    q->size.fetch_sub(pkt1->pkt->size + sizeof(*pkt1), std::memory_order_relaxed);
+    q->duration.fetch_sub(pkt1->pkt->duration, std::memory_order_relaxed);
+    bytes = q->continue_read->bytes.fetch_sub(pkt1->pkt->size + sizeof(*pkt1), std::memory_order_relaxed) -
+            (pkt1->pkt->size + sizeof(*pkt1));
+    packet_queue_wake(q);
+    /* the byte cap of read_thread_queues_full() has a low water of its own */
+    if (packet_queue_low(q) || bytes <= LOW_WATER_SIZE)
+        read_wakeup_signal(q->continue_read);
+    return 1;
+}
+
+static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
+{
+    MyAVPacketList *pkt1;
+    unsigned windex;
+    int nb_packets, size;
+
+    for (;;) {
+        if (q->abort_request)
+            return -1;
+        if (!packet_queue_full(q))
+            break;
+        packet_queue_wait(q, 1, q->serial.load(std::memory_order_acquire));
+    }
+
+    windex = q->windex.load(std::memory_order_relaxed);
+    pkt1 = &q->pkt_list[windex & (PACKET_QUEUE_SIZE - 1)];
+    pkt1->pkt = pkt;
+    /* the serial may be bumped by packet_queue_flush/start on another thread;
+       a packet stamped just before that is discarded by its serial anyway */
+    pkt1->serial = q->serial.load(std::memory_order_acquire);
+
+    nb_packets = q->nb_packets.fetch_add(1, std::memory_order_relaxed) + 1;
+    size = q->size.fetch_add(pkt->size + sizeof(*pkt1), std::memory_order_relaxed) + pkt->size + sizeof(*pkt1);
+    q->continue_read->bytes.fetch_add(pkt->size + sizeof(*pkt1), std::memory_order_relaxed);
+    q->duration.fetch_add(pkt->duration, std::memory_order_relaxed);
+    q->windex.store(windex + 1, std::memory_order_release);
+    q->peak_nb_packets = FFMAX(q->peak_nb_packets, nb_packets);
+    q->peak_size = FFMAX(q->peak_size, size);
     /* XXX: should duplicate packet data in DV case */
-    SDL_CondSignal(q->cond);
+    packet_queue_wake(q);
     return 0;
 }
 
 static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
 {
     AVPacket *pkt1;
+    int64_t trace = trace_begin();
     int ret;
 
-    pkt1 = av_packet_alloc();
+    pkt1 = packet_pool_get(&q->pool);
     if (!pkt1) {
         av_packet_unref(pkt);
         return -1;
     }
     av_packet_move_ref(pkt1, pkt);
 
-    SDL_LockMutex(q->mutex);
     ret = packet_queue_put_private(q, pkt1);
-    SDL_UnlockMutex(q->mutex);
 
     if (ret < 0)
         av_packet_free(&pkt1);
 
+    trace_end("packet_queue_put", trace);
     return ret;
 }
 
@@ -655,12 +1443,22 @@ static int packet_queue_put_nullpacket(PacketQueue *q, AVPacket *pkt, int stream
 }
 
 /* packet queue handling */
-static int packet_queue_init(PacketQueue *q)
+static int packet_queue_init(PacketQueue *q, ReadWakeup *continue_read)
 {
-    memset(q, 0, sizeof(PacketQueue));
-    q->pkt_list = av_fifo_alloc2(1, sizeof(MyAVPacketList), AV_FIFO_FLAG_AUTO_GROW);
+    q->pkt_list = static_cast<MyAVPacketList*>(av_calloc(PACKET_QUEUE_SIZE, sizeof(*q->pkt_list)));
     if (!q->pkt_list)
         return AVERROR(ENOMEM);
+    if (packet_pool_init(&q->pool) < 0)
+        return AVERROR(ENOMEM);
+    q->windex = 0;
+    q->rindex = 0;
+    q->nb_packets = 0;
+    q->size = 0;
+    q->duration = 0;
+    q->serial = 0;
+    q->nb_waiters = 0;
+    q->low_water_duration = 0;
+    q->continue_read = continue_read;
     q->mutex = SDL_CreateMutex();
     if (!q->mutex) {
         av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
@@ -679,20 +1477,21 @@ static void packet_queue_flush(PacketQueue *q)
 {
     MyAVPacketList pkt1;
 
-    SDL_LockMutex(q->mutex);
-    while (av_fifo_read(q->pkt_list, &pkt1, 1) >= 0)
+    while (packet_queue_pop(q, &pkt1))
         av_packet_free(&pkt1.pkt);
-    q->nb_packets = 0;
-    q->size = 0;
-    q->duration = 0;
+    SDL_LockMutex(q->mutex);
     q->serial++;
+    /* a decoder blocked on the empty queue has to notice the flush, reverse
+       playback stops demuxing and would otherwise never wake it */
+    SDL_CondBroadcast(q->cond);
     SDL_UnlockMutex(q->mutex);
 }
 
 static void packet_queue_destroy(PacketQueue *q)
 {
     packet_queue_flush(q);
-    av_fifo_freep2(&q->pkt_list);
+    av_freep(&q->pkt_list);
+    packet_pool_destroy(&q->pool);
     SDL_DestroyMutex(q->mutex);
     SDL_DestroyCond(q->cond);
 }
@@ -714,168 +1513,1904 @@ static void packet_queue_start(PacketQueue *q)
     q->abort_request = 0;
     q->serial++;
     SDL_UnlockMutex(q->mutex);
+    /* an empty queue just joined, read_thread has to fill it */
+    read_wakeup_signal(q->continue_read);
+}
+
+static void packet_queue_log_pool(PacketQueue *q, const char *name)
+{
+    av_log(NULL, AV_LOG_VERBOSE, "%s packet pool: %" PRId64 " hits, %" PRId64 " misses\n",
+           name, q->pool.hits.load(), q->pool.misses.load());
 }
 
-/* return < 0 if aborted, 0 if no packet and > 0 if packet.  */
+/* return < 0 if aborted, 0 if no packet (or, blocking, the queue was flushed
+   while waiting) and > 0 if packet.  */
 static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *serial)
 {
     MyAVPacketList pkt1;
-    int ret;
-
-    SDL_LockMutex(q->mutex);
 
     for (;;) {
-        if (q->abort_request) {
-            ret = -1;
-            break;
-        }
+        if (q->abort_request)
+            return -1;
 
-        if (av_fifo_read(q->pkt_list, &pkt1, 1) >= 0) {
-            q->nb_packets--;
-            q->size -= pkt1.pkt->size + sizeof(pkt1);
-            q->duration -= pkt1.pkt->duration;
+        if (packet_queue_pop(q, &pkt1)) {
             av_packet_move_ref(pkt, pkt1.pkt);
             if (serial)
                 *serial = pkt1.serial;
-            av_packet_free(&pkt1.pkt);
-            ret = 1;
-            break;
+            packet_pool_put(&q->pool, pkt1.pkt);
+            return 1;
         } else if (!block) {
-            ret = 0;
-            break;
+            return 0;
         } else {
-            SDL_CondWait(q->cond, q->mutex);
+            int serial = q->serial.load(std::memory_order_acquire);
+
+            packet_queue_wait(q, 0, serial);
+            /* flushed while waiting, let the caller look at the new serial */
+            if (q->serial.load(std::memory_order_acquire) != serial)
+                return 0;
         }
     }
-    SDL_UnlockMutex(q->mutex);
-    return ret;
 }
 
 
 
 
 //              ##########################################
-//                         Opt Functions
+//                         Read-Ahead Functions
 //              ##########################################
 
-static int opt_add_vfilter(void *optctx, const char *opt, const char *arg)
+static int readahead_thread(void *arg)
 {
-    int ret = GROW_ARRAY(vfilters_list, nb_vfilters);
-    if (ret < 0)
-        return ret;
+    ReadAhead *ra = static_cast<ReadAhead *>(arg);
+    int64_t src_pos = avio_tell(ra->src);
 
-    vfilters_list[nb_vfilters - 1] = av_strdup(arg);
-    if (!vfilters_list[nb_vfilters - 1])
-        return AVERROR(ENOMEM);
+    SDL_LockMutex(ra->mutex);
+    for (;;) {
+        int64_t offset;
+        int generation, len, ret;
+
+        while (!ra->abort_request && (ra->eof || ra->error || ra->buf_end - ra->pos >= ra->window))
+            SDL_CondWait(ra->cond, ra->mutex);
+        if (ra->abort_request)
+            break;
 
+        /* make room by dropping the oldest consumed bytes, never unread ones */
+        offset = ra->buf_end;
+        len = FFMIN3(READAHEAD_CHUNK_SIZE, ra->window - (offset - ra->pos),
+                     ra->buf_size - (int)(offset % ra->buf_size));
+        ra->buf_start = FFMAX(ra->buf_start, offset + len - ra->buf_size);
+        generation = ra->generation;
+        SDL_UnlockMutex(ra->mutex);
+
+        ret = 0;
+        if (offset != src_pos) {
+            int64_t pos = avio_seek(ra->src, offset, SEEK_SET);
+            if (pos < 0)
+                ret = pos;
+            else
+                src_pos = pos;
+        }
+        if (!ret)
+            ret = avio_read(ra->src, ra->buf + offset % ra->buf_size, len);
+        if (ret > 0)
+            src_pos += ret;
+
+        SDL_LockMutex(ra->mutex);
+        /* a seek dropped the range this chunk belongs to */
+        if (generation != ra->generation)
+            continue;
+        if (ret > 0) {
+            ra->buf_end += ret;
+            ra->prefetched += ret;
+        } else if (ret == AVERROR_EOF || !ret) {
+            ra->eof = 1;
+        } else {
+            ra->error = ret;
+        }
+        SDL_CondSignal(ra->cond);
+    }
+    SDL_UnlockMutex(ra->mutex);
     return 0;
 }
 
-static int opt_width(void *optctx, const char *opt, const char *arg)
+static int readahead_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    ReadAhead *ra = static_cast<ReadAhead *>(opaque);
+    int len;
+
+    SDL_LockMutex(ra->mutex);
+    while (!ra->abort_request && ra->pos == ra->buf_end && !ra->eof && !ra->error)
+        SDL_CondWait(ra->cond, ra->mutex);
+    if (ra->abort_request || ra->pos == ra->buf_end) {
+        len = ra->abort_request ? AVERROR_EXIT : ra->error ? ra->error : AVERROR_EOF;
+    } else {
+        len = FFMIN3(buf_size, ra->buf_end - ra->pos, ra->buf_size - (int)(ra->pos % ra->buf_size));
+        memcpy(buf, ra->buf + ra->pos % ra->buf_size, len);
+        ra->pos += len;
+        ra->consumed += len;
+        SDL_CondSignal(ra->cond);
+    }
+    SDL_UnlockMutex(ra->mutex);
+    return len;
+}
+
+/* seeks inside the buffered range only move the read position, anything else
+   drops the buffer and restarts the reader at the new offset */
+static int64_t readahead_seek(void *opaque, int64_t offset, int whence)
+{
+    ReadAhead *ra = static_cast<ReadAhead *>(opaque);
+    int64_t target;
+
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE)
+        return ra->file_size >= 0 ? ra->file_size : AVERROR(ENOSYS);
+
+    SDL_LockMutex(ra->mutex);
+    if (whence == SEEK_SET)
+        target = offset;
+    else if (whence == SEEK_CUR)
+        target = ra->pos + offset;
+    else if (whence == SEEK_END && ra->file_size >= 0)
+        target = ra->file_size + offset;
+    else
+        target = AVERROR(EINVAL);
+
+    if (target >= ra->buf_start && target <= ra->buf_end) {
+        ra->pos = target;
+        ra->seeks_reused++;
+    } else if (target >= 0) {
+        ra->buf_start = ra->buf_end = ra->pos = target;
+        ra->eof = ra->error = 0;
+        ra->generation++;
+        ra->seeks_dropped++;
+    }
+    SDL_CondSignal(ra->cond);
+    SDL_UnlockMutex(ra->mutex);
+    return target;
+}
+
+static void readahead_abort(ReadAhead *ra)
+{
+    SDL_LockMutex(ra->mutex);
+    ra->abort_request = 1;
+    SDL_CondBroadcast(ra->cond);
+    SDL_UnlockMutex(ra->mutex);
+}
+
+static void readahead_close(ReadAhead **pra)
+{
+    ReadAhead *ra = *pra;
+
+    if (!ra)
+        return;
+    if (ra->tid) {
+        readahead_abort(ra);
+        SDL_WaitThread(ra->tid, NULL);
+        av_log(NULL, AV_LOG_VERBOSE, "read-ahead: %" PRId64 " KB prefetched, %" PRId64 " KB consumed, "
+               "%d seeks served from the buffer, %d refetched\n",
+               ra->prefetched / 1024, ra->consumed / 1024, ra->seeks_reused, ra->seeks_dropped);
+    }
+    if (ra->pb)
+        av_freep(&ra->pb->buffer);
+    avio_context_free(&ra->pb);
+    avio_closep(&ra->src);
+    av_freep(&ra->buf);
+    SDL_DestroyMutex(ra->mutex);
+    SDL_DestroyCond(ra->cond);
+    av_freep(pra);
+}
+
+/* open url and put a read-ahead buffer of buf_size bytes, prefetching up to
+   window bytes, in front of it */
+static int readahead_open(ReadAhead **pra, const char *url, int buf_size, int window,
+                          const AVIOInterruptCB *int_cb, AVDictionary **options)
+{
+    ReadAhead *ra;
+    uint8_t *io_buffer;
+    int ret;
+
+    ra = static_cast<ReadAhead *>(av_mallocz(sizeof(*ra)));
+    if (!ra)
+        return AVERROR(ENOMEM);
+    *pra = ra;
+    ra->buf_size = buf_size;
+    ra->window   = window > 0 ? FFMIN(window, buf_size) : buf_size / 2;
+
+    if ((ret = avio_open2(&ra->src, url, AVIO_FLAG_READ, int_cb, options)) < 0)
+        goto fail;
+    ra->file_size = avio_size(ra->src);
+    ra->buf_start = ra->buf_end = ra->pos = avio_tell(ra->src);
+
+    ra->buf = static_cast<uint8_t *>(av_malloc(buf_size));
+    io_buffer = static_cast<uint8_t *>(av_malloc(CUSTOM_IO_BUFFER_SIZE));
+    if (!ra->buf || !io_buffer) {
+        av_free(io_buffer);
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    ra->pb = avio_alloc_context(io_buffer, CUSTOM_IO_BUFFER_SIZE, 0, ra,
+                                readahead_read_packet, NULL, readahead_seek);
+    if (!ra->pb) {
+        av_free(io_buffer);
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    ra->pb->seekable = ra->src->seekable;
+
+    if (!(ra->mutex = SDL_CreateMutex()) || !(ra->cond = SDL_CreateCond())) {
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex/Cond(): %s\n", SDL_GetError());
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    ra->tid = SDL_CreateThread(readahead_thread, "readahead", ra);
+    if (!ra->tid) {
+        av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    return 0;
+fail:
+    readahead_close(pra);
+    return ret;
+}
+
+
+//              ##########################################
+//                        Mapped Input Functions
+//              ##########################################
+
+static void mapped_input_unmap(void *opaque, uint8_t *data)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap(data, (size_t)(uintptr_t)opaque);
+#endif
+}
+
+/* page in the MMAP_WILLNEED_SIZE bytes following pos, seeks always restart the window */
+static void mapped_input_advise(MappedInput *mi, int64_t pos, int seek)
+{
+#ifndef _WIN32
+    long page = sysconf(_SC_PAGESIZE);
+    int64_t start, end;
+
+    if (!seek && pos + MMAP_WILLNEED_SIZE / 2 < mi->willneed_end)
+        return;
+    start = FFMAX(seek ? pos : mi->willneed_end, 0) & ~(int64_t)(page - 1);
+    end   = FFMIN(pos + MMAP_WILLNEED_SIZE, (int64_t)mi->map->size);
+    if (start < end)
+        madvise(mi->map->data + start, end - start, MADV_WILLNEED);
+    mi->willneed_end = end;
+#endif
+}
+
+static int mapped_input_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    MappedInput *mi = static_cast<MappedInput *>(opaque);
+    int len = FFMIN(buf_size, (int64_t)mi->map->size - mi->pos);
+
+    if (len <= 0)
+        return AVERROR_EOF;
+    memcpy(buf, mi->map->data + mi->pos, len);
+    mi->pos += len;
+    mapped_input_advise(mi, mi->pos, 0);
+    return len;
+}
+
+static int64_t mapped_input_seek(void *opaque, int64_t offset, int whence)
+{
+    MappedInput *mi = static_cast<MappedInput *>(opaque);
+    int64_t target;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return mi->map->size;
+    case SEEK_SET:    target = offset;                  break;
+    case SEEK_CUR:    target = mi->pos + offset;        break;
+    case SEEK_END:    target = mi->map->size + offset;  break;
+    default:          return AVERROR(EINVAL);
+    }
+    if (target < 0)
+        return AVERROR(EINVAL);
+    mi->pos = target;
+    mapped_input_advise(mi, target, 1);
+    return target;
+}
+
+static void mapped_input_close(MappedInput **pmi)
+{
+    MappedInput *mi = *pmi;
+
+    if (!mi)
+        return;
+    if (mi->pb)
+        av_freep(&mi->pb->buffer);
+    avio_context_free(&mi->pb);
+    av_buffer_unref(&mi->map);
+    av_freep(pmi);
+}
+
+/* return the file system path of url if it is handled by the file protocol */
+static const char *local_file_path(const char *url)
+{
+    const char *proto = avio_find_protocol_name(url);
+    const char *path = url;
+
+    if (!proto || strcmp(proto, "file"))
+        return NULL;
+    av_strstart(url, "file:", &path);
+    return path;
+}
+
+/* map the whole file behind a local url, return AVERROR(ENOSYS) for anything
+   that is not handled by the file protocol */
+static int mapped_input_open(MappedInput **pmi, const char *url)
+{
+    MappedInput *mi;
+    const char *path = local_file_path(url);
+    uint8_t *data = NULL, *io_buffer;
+    int64_t size = 0;
+
+    if (!path)
+        return AVERROR(ENOSYS);
+
+#ifdef _WIN32
+    {
+        wchar_t *wpath;
+        HANDLE file, mapping;
+        LARGE_INTEGER li;
+        int n = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+
+        if (n <= 0 || !(wpath = static_cast<wchar_t *>(av_malloc_array(n, sizeof(*wpath)))))
+            return AVERROR(ENOMEM);
+        MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, n);
+        file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        av_free(wpath);
+        if (file == INVALID_HANDLE_VALUE)
+            return AVERROR(ENOENT);
+        if (GetFileSizeEx(file, &li))
+            size = li.QuadPart;
+        mapping = size > 0 ? CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+        CloseHandle(file);
+        if (!mapping)
+            return AVERROR(EINVAL);
+        data = static_cast<uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        CloseHandle(mapping);
+        if (!data)
+            return AVERROR(ENOMEM);
+    }
+#else
+    {
+        struct stat st;
+        void *addr;
+        int fd = open(path, O_RDONLY);
+
+        if (fd < 0)
+            return AVERROR(errno);
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+            size = st.st_size;
+        if (size <= 0 || (uint64_t)size > SIZE_MAX) {
+            close(fd);
+            return AVERROR(EINVAL);
+        }
+        addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+            return AVERROR(errno);
+        data = static_cast<uint8_t *>(addr);
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+#endif
+
+    mi = static_cast<MappedInput *>(av_mallocz(sizeof(*mi)));
+    if (!mi) {
+        mapped_input_unmap((void *)(uintptr_t)size, data);
+        return AVERROR(ENOMEM);
+    }
+    *pmi = mi;
+    mi->map = av_buffer_create(data, size, mapped_input_unmap, (void *)(uintptr_t)size, AV_BUFFER_FLAG_READONLY);
+    if (!mi->map) {
+        mapped_input_unmap((void *)(uintptr_t)size, data);
+        goto fail;
+    }
+    io_buffer = static_cast<uint8_t *>(av_malloc(CUSTOM_IO_BUFFER_SIZE));
+    if (!io_buffer)
+        goto fail;
+    mi->pb = avio_alloc_context(io_buffer, CUSTOM_IO_BUFFER_SIZE, 0, mi,
+                                mapped_input_read_packet, NULL, mapped_input_seek);
+    if (!mi->pb) {
+        av_free(io_buffer);
+        goto fail;
+    }
+    /* read straight from the mapping into the caller's buffer */
+    mi->pb->direct = 1;
+    mi->pb->seekable = AVIO_SEEKABLE_NORMAL;
+    mapped_input_advise(mi, 0, 1);
+    return 0;
+fail:
+    mapped_input_close(pmi);
+    return AVERROR(ENOMEM);
+}
+
+
+//              ##########################################
+//                       Keyframe Index Functions
+//              ##########################################
+
+static int keyframe_index_cmp(const void *a, const void *b)
+{
+    int64_t ta = static_cast<const KeyframeIndexEntry *>(a)->ts;
+    int64_t tb = static_cast<const KeyframeIndexEntry *>(b)->ts;
+    return (ta > tb) - (ta < tb);
+}
+
+static int keyframe_index_add(KeyframeIndex *ki, int64_t ts, int64_t pos)
+{
+    if (ki->nb_entries >= ki->nb_allocated) {
+        int nb = FFMAX(2 * ki->nb_allocated, 1024);
+        void *entries = av_realloc_array(ki->entries, nb, sizeof(*ki->entries));
+        if (!entries)
+            return AVERROR(ENOMEM);
+        ki->entries = static_cast<KeyframeIndexEntry *>(entries);
+        ki->nb_allocated = nb;
+    }
+    ki->entries[ki->nb_entries].ts  = ts;
+    ki->entries[ki->nb_entries].pos = pos;
+    ki->nb_entries++;
+    return 0;
+}
+
+/* sidecar layout: magic, file size, file mtime, stream index, entry count, entries */
+static int keyframe_index_load(KeyframeIndex *ki)
+{
+    char magic[sizeof(KEYFRAME_INDEX_MAGIC) - 1];
+    int64_t file_size, file_mtime;
+    int32_t stream_index, nb_entries;
+    FILE *f = fopen(ki->sidecar, "rb");
+    int ret = AVERROR_INVALIDDATA;
+
+    if (!f)
+        return AVERROR(ENOENT);
+    if (fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, KEYFRAME_INDEX_MAGIC, sizeof(magic)) &&
+        fread(&file_size, sizeof(file_size), 1, f) == 1 && file_size == ki->file_size &&
+        fread(&file_mtime, sizeof(file_mtime), 1, f) == 1 && file_mtime == ki->file_mtime &&
+        fread(&stream_index, sizeof(stream_index), 1, f) == 1 && stream_index == ki->stream_index &&
+        fread(&nb_entries, sizeof(nb_entries), 1, f) == 1 && nb_entries > 0) {
+        ki->entries = static_cast<KeyframeIndexEntry *>(av_malloc_array(nb_entries, sizeof(*ki->entries)));
+        if (!ki->entries) {
+            ret = AVERROR(ENOMEM);
+        } else if (fread(ki->entries, sizeof(*ki->entries), nb_entries, f) == (size_t)nb_entries) {
+            ki->nb_entries = ki->nb_allocated = nb_entries;
+            ret = 0;
+        } else {
+            av_freep(&ki->entries);
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+static void keyframe_index_save(KeyframeIndex *ki)
+{
+    int32_t stream_index = ki->stream_index, nb_entries = ki->nb_entries;
+    FILE *f = fopen(ki->sidecar, "wb");
+    int ok;
+
+    if (!f) {
+        av_log(NULL, AV_LOG_VERBOSE, "Could not write keyframe index %s\n", ki->sidecar);
+        return;
+    }
+    ok = fwrite(KEYFRAME_INDEX_MAGIC, sizeof(KEYFRAME_INDEX_MAGIC) - 1, 1, f) == 1 &&
+         fwrite(&ki->file_size, sizeof(ki->file_size), 1, f) == 1 &&
+         fwrite(&ki->file_mtime, sizeof(ki->file_mtime), 1, f) == 1 &&
+         fwrite(&stream_index, sizeof(stream_index), 1, f) == 1 &&
+         fwrite(&nb_entries, sizeof(nb_entries), 1, f) == 1 &&
+         fwrite(ki->entries, sizeof(*ki->entries), nb_entries, f) == (size_t)nb_entries;
+    if (fclose(f) || !ok) {
+        av_log(NULL, AV_LOG_VERBOSE, "Could not write keyframe index %s\n", ki->sidecar);
+        remove(ki->sidecar);
+    }
+}
+
+static int keyframe_index_interrupt_cb(void *ctx)
+{
+    return static_cast<KeyframeIndex *>(ctx)->abort_request;
+}
+
+/* demux the input once on a context of our own and record every keyframe of
+   the indexed stream */
+static int keyframe_index_thread(void *arg)
+{
+    KeyframeIndex *ki = static_cast<KeyframeIndex *>(arg);
+    AVFormatContext *ic = avformat_alloc_context();
+    AVPacket *pkt = av_packet_alloc();
+    int64_t start = av_gettime_relative();
+    AVDictionary *opts = NULL;
+    int i, ret;
+
+    if (!ic || !pkt || av_dict_copy(&opts, ki->format_opts, 0) < 0)
+        goto end;
+    ic->interrupt_callback.callback = keyframe_index_interrupt_cb;
+    ic->interrupt_callback.opaque = ki;
+    if (avformat_open_input(&ic, ki->url, ki->iformat, &opts) < 0)
+        goto end;
+    if (avformat_find_stream_info(ic, NULL) < 0 || ki->stream_index >= (int)ic->nb_streams)
+        goto end;
+    for (i = 0; i < (int)ic->nb_streams; i++)
+        ic->streams[i]->discard = i == ki->stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    while (!ki->abort_request && (ret = av_read_frame(ic, pkt)) >= 0) {
+        int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+        if (pkt->stream_index == ki->stream_index && (pkt->flags & AV_PKT_FLAG_KEY) &&
+            pkt->pos >= 0 && ts != AV_NOPTS_VALUE &&
+            keyframe_index_add(ki, av_rescale_q(ts, ic->streams[ki->stream_index]->time_base, AV_TIME_BASE_Q), pkt->pos) < 0) {
+            av_packet_unref(pkt);
+            goto end;
+        }
+        av_packet_unref(pkt);
+    }
+    if (ki->abort_request || ret != AVERROR_EOF || !ki->nb_entries)
+        goto end;
+
+    qsort(ki->entries, ki->nb_entries, sizeof(*ki->entries), keyframe_index_cmp);
+    keyframe_index_save(ki);
+    av_log(NULL, AV_LOG_VERBOSE, "Built keyframe index of %d entries in %.1fs\n",
+           ki->nb_entries, (av_gettime_relative() - start) / 1000000.0);
+    ki->complete.store(1, std::memory_order_release);
+end:
+    av_dict_free(&opts);
+    av_packet_free(&pkt);
+    avformat_close_input(&ic);
+    return 0;
+}
+
+static void keyframe_index_close(KeyframeIndex **pki)
+{
+    KeyframeIndex *ki = *pki;
+
+    if (!ki)
+        return;
+    ki->abort_request = 1;
+    SDL_WaitThread(ki->tid, NULL);
+    av_freep(&ki->entries);
+    av_freep(&ki->url);
+    av_freep(&ki->sidecar);
+    av_dict_free(&ki->format_opts);
+    av_freep(pki);
+}
+
+/* load the keyframe index of stream_index of a local file from its sidecar, or
+   start building it in the background */
+static int keyframe_index_open(KeyframeIndex **pki, const char *url, const AVInputFormat *iformat,
+                               const AVDictionary *format_opts, int stream_index)
+{
+    KeyframeIndex *ki;
+    const char *path = local_file_path(url);
+    struct stat st;
+
+    if (!path || stat(path, &st) || !S_ISREG(st.st_mode))
+        return AVERROR(ENOSYS);
+
+    ki = static_cast<KeyframeIndex *>(av_mallocz(sizeof(*ki)));
+    if (!ki)
+        return AVERROR(ENOMEM);
+    *pki = ki;
+    ki->url = av_strdup(url);
+    ki->sidecar = av_asprintf("%s%s", path, KEYFRAME_INDEX_SUFFIX);
+    if (!ki->url || !ki->sidecar || av_dict_copy(&ki->format_opts, format_opts, 0) < 0)
+        goto fail;
+    ki->iformat = iformat;
+    ki->file_size = st.st_size;
+    ki->file_mtime = st.st_mtime;
+    ki->stream_index = stream_index;
+
+    if (keyframe_index_load(ki) >= 0) {
+        av_log(NULL, AV_LOG_VERBOSE, "Loaded keyframe index of %d entries from %s\n", ki->nb_entries, ki->sidecar);
+        ki->complete = 1;
+        return 0;
+    }
+    ki->tid = SDL_CreateThread(keyframe_index_thread, "keyframe_index", ki);
+    if (!ki->tid) {
+        av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+        goto fail;
+    }
+    return 0;
+fail:
+    keyframe_index_close(pki);
+    return AVERROR(ENOMEM);
+}
+
+/* find the keyframe to seek to for target, preferring the last one at or before
+   it but staying within [min_ts, max_ts], return NULL if the index cannot help */
+static const KeyframeIndexEntry *keyframe_index_lookup(KeyframeIndex *ki, int64_t min_ts, int64_t target, int64_t max_ts)
+{
+    int lo = 0, hi;
+
+    if (!ki || !ki->complete.load(std::memory_order_acquire))
+        return NULL;
+    /* first entry after target */
+    hi = ki->nb_entries;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ki->entries[mid].ts <= target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && ki->entries[lo - 1].ts >= min_ts)
+        return &ki->entries[lo - 1];
+    if (lo < ki->nb_entries && ki->entries[lo].ts <= max_ts)
+        return &ki->entries[lo];
+    return NULL;
+}
+
+
+//              ##########################################
+//                          GOP Cache Functions
+//              ##########################################
+
+static int gop_cache_frame_cmp(const void *a, const void *b)
+{
+    int64_t pa = (*static_cast<AVFrame *const *>(a))->pts;
+    int64_t pb = (*static_cast<AVFrame *const *>(b))->pts;
+    return (pa > pb) - (pa < pb);
+}
+
+static void gop_cache_entry_free(GopCacheEntry *gop)
+{
+    int i;
+
+    for (i = 0; i < gop->nb_frames; i++)
+        av_frame_free(&gop->frames[i]);
+    av_freep(&gop->frames);
+    gop->nb_frames = gop->nb_allocated = 0;
+    gop->bytes = 0;
+}
+
+static int gop_cache_entry_add(GopCacheEntry *gop, AVFrame *src)
+{
+    AVFrame *frame;
+    int i;
+
+    if (gop->nb_frames >= gop->nb_allocated) {
+        int nb = FFMAX(2 * gop->nb_allocated, 64);
+        void *frames = av_realloc_array(gop->frames, nb, sizeof(*gop->frames));
+        if (!frames)
+            return AVERROR(ENOMEM);
+        gop->frames = static_cast<AVFrame **>(frames);
+        gop->nb_allocated = nb;
+    }
+    if (!(frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    av_frame_move_ref(frame, src);
+    for (i = 0; i < (int)FF_ARRAY_ELEMS(frame->buf) && frame->buf[i]; i++)
+        gop->bytes += frame->buf[i]->size;
+    gop->frames[gop->nb_frames++] = frame;
+    return 0;
+}
+
+static void gop_cache_entry_drop(GopCacheEntry *gop, int i)
+{
+    int j;
+
+    for (j = 0; j < (int)FF_ARRAY_ELEMS(gop->frames[i]->buf) && gop->frames[i]->buf[j]; j++)
+        gop->bytes -= gop->frames[i]->buf[j]->size;
+    av_frame_free(&gop->frames[i]);
+    memmove(gop->frames + i, gop->frames + i + 1, (gop->nb_frames - i - 1) * sizeof(*gop->frames));
+    gop->nb_frames--;
+}
+
+/* index of the cached GOP containing pts, -1 if none; called with the mutex held */
+static int gop_cache_find(GopCache *c, int64_t pts)
+{
+    int i;
+
+    for (i = 0; i < c->nb_gops; i++)
+        if (c->gops[i].key_pts <= pts && pts < c->gops[i].end_pts)
+            return i;
+    return -1;
+}
+
+/* take ownership of gop and evict the least recently used GOPs above the memory
+   cap, the new one is always kept, gop_cache_decode() keeps it under the cap;
+   called with the mutex held */
+static int gop_cache_insert(GopCache *c, GopCacheEntry *gop)
+{
+    void *gops = av_realloc_array(c->gops, c->nb_gops + 1, sizeof(*c->gops));
+    int i;
+
+    if (!gops)
+        return AVERROR(ENOMEM);
+    c->gops = static_cast<GopCacheEntry *>(gops);
+    gop->last_used = ++c->use_clock;
+    c->gops[c->nb_gops++] = *gop;
+    c->bytes += gop->bytes;
+
+    while (c->bytes > c->max_bytes && c->nb_gops > 1) {
+        int oldest = 0;
+        for (i = 1; i < c->nb_gops; i++)
+            if (c->gops[i].last_used < c->gops[oldest].last_used)
+                oldest = i;
+        c->bytes -= c->gops[oldest].bytes;
+        gop_cache_entry_free(&c->gops[oldest]);
+        c->gops[oldest] = c->gops[--c->nb_gops];
+    }
+    return 0;
+}
+
+/* decode the GOP containing target into gop, from its keyframe up to the next one.
+   Long GOPs and intra refresh streams without periodic keyframes can exceed the
+   memory cap on their own: only a window of the frames up to target is kept then,
+   stepping further back decodes the GOP again for the window before. */
+static int gop_cache_decode(GopCache *c, AVFormatContext *ic, AVCodecContext *dec,
+                            AVPacket *pkt, AVFrame *frame, int64_t target, GopCacheEntry *gop)
+{
+    int draining = 0, windowed = 0, past_target = 0, ret;
+
+    gop->key_pts = AV_NOPTS_VALUE;
+    gop->end_pts = INT64_MAX;
+    avcodec_flush_buffers(dec);
+    ret = avformat_seek_file(ic, c->stream_index, INT64_MIN, target, target, 0);
+    if (ret < 0) /* target lies before the first keyframe */
+        ret = avformat_seek_file(ic, c->stream_index, INT64_MIN, target, INT64_MAX, 0);
+    if (ret < 0)
+        return ret;
+
+    while (!c->abort_request) {
+        if (!draining) {
+            ret = av_read_frame(ic, pkt);
+            if (ret < 0 && ret != AVERROR_EOF)
+                return ret;
+            if (ret >= 0) {
+                int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+                int key = (pkt->flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE;
+
+                if (pkt->stream_index != c->stream_index || (gop->key_pts == AV_NOPTS_VALUE && !key)) {
+                    av_packet_unref(pkt);
+                    continue;
+                }
+                if (gop->key_pts == AV_NOPTS_VALUE) {
+                    gop->key_pts = ts;
+                } else if (key && ts > gop->key_pts) {
+                    gop->end_pts = ts;
+                    draining = 1;
+                }
+            } else {
+                draining = 1;
+            }
+            /* decoding errors only cost the frames concerned, as in the player */
+            avcodec_send_packet(dec, draining ? NULL : pkt);
+            av_packet_unref(pkt);
+        }
+        while ((ret = avcodec_receive_frame(dec, frame)) >= 0) {
+            frame->pts = frame->best_effort_timestamp;
+            if (frame->pts == AV_NOPTS_VALUE || frame->pts < gop->key_pts || frame->pts >= gop->end_pts ||
+                (windowed && frame->pts > target)) {
+                past_target |= windowed && frame->pts != AV_NOPTS_VALUE && frame->pts > target;
+                av_frame_unref(frame);
+                continue;
+            }
+            if ((ret = gop_cache_entry_add(gop, frame)) < 0)
+                return ret;
+            /* over the cap: frames after target go first, then the oldest ones */
+            while (gop->bytes > c->max_bytes && gop->nb_frames > 1) {
+                gop_cache_entry_drop(gop, gop->frames[gop->nb_frames - 1]->pts > target ? gop->nb_frames - 1 : 0);
+                windowed = 1;
+            }
+        }
+        /* the window is complete, the rest of the GOP is not needed */
+        if (past_target)
+            break;
+        if (ret == AVERROR_EOF)
+            break;
+        if (ret != AVERROR(EAGAIN))
+            return ret;
+    }
+    if (c->abort_request)
+        return AVERROR_EXIT;
+    qsort(gop->frames, gop->nb_frames, sizeof(*gop->frames), gop_cache_frame_cmp);
+    if (windowed) {
+        while (gop->nb_frames > 1 && gop->frames[gop->nb_frames - 1]->pts > target)
+            gop_cache_entry_drop(gop, gop->nb_frames - 1);
+        av_log(NULL, c->nb_windowed++ ? AV_LOG_DEBUG : AV_LOG_WARNING,
+               "GOP at pts %" PRId64 " exceeds the %d MB GOP cache, reverse playback keeps %d frames of it at a time\n",
+               gop->key_pts, (int)(c->max_bytes >> 20), gop->nb_frames);
+        gop->key_pts = gop->frames[0]->pts;
+        gop->end_pts = FFMIN(gop->end_pts, target + 1);
+    }
+    return 0;
+}
+
+static int gop_cache_interrupt_cb(void *ctx)
+{
+    return static_cast<GopCache *>(ctx)->abort_request;
+}
+
+static int gop_cache_thread(void *arg)
+{
+    GopCache *c = static_cast<GopCache *>(arg);
+    AVFormatContext *ic = avformat_alloc_context();
+    AVCodecContext *dec = NULL;
+    const AVCodec *codec;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVStream *st;
+    int i, ret;
+
+    if (!ic || !pkt || !frame)
+        goto fail;
+    ic->interrupt_callback.callback = gop_cache_interrupt_cb;
+    ic->interrupt_callback.opaque = c;
+    if (avformat_open_input(&ic, c->url, c->iformat, NULL) < 0 ||
+        avformat_find_stream_info(ic, NULL) < 0 || c->stream_index >= (int)ic->nb_streams)
+        goto fail;
+    st = ic->streams[c->stream_index];
+    if (st->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
+        goto fail;
+    for (i = 0; i < (int)ic->nb_streams; i++)
+        ic->streams[i]->discard = i == c->stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    codec = c->codec_name ? avcodec_find_decoder_by_name(c->codec_name) : avcodec_find_decoder(st->codecpar->codec_id);
+    if (!codec || !(dec = avcodec_alloc_context3(codec)) ||
+        avcodec_parameters_to_context(dec, st->codecpar) < 0)
+        goto fail;
+    dec->pkt_timebase = st->time_base;
+    dec->thread_count = 0;
+    if (avcodec_open2(dec, codec, NULL) < 0)
+        goto fail;
+
+    SDL_LockMutex(c->mutex);
+    while (!c->abort_request) {
+        GopCacheEntry gop = {};
+        int64_t target;
+
+        if (c->request_pts != AV_NOPTS_VALUE) {
+            target = c->request_pts;
+        } else if (c->prefetch_pts != AV_NOPTS_VALUE) {
+            target = c->prefetch_pts;
+        } else {
+            SDL_CondWait(c->cond, c->mutex);
+            continue;
+        }
+        if (target >= c->start_pts && gop_cache_find(c, target) < 0) {
+            int64_t start = av_gettime_relative();
+
+            SDL_UnlockMutex(c->mutex);
+            ret = gop_cache_decode(c, ic, dec, pkt, frame, target, &gop);
+            SDL_LockMutex(c->mutex);
+            if (ret >= 0 && gop.nb_frames && target < gop.end_pts) {
+                /* target precedes the first keyframe, there is nothing before it */
+                if (gop.key_pts > target)
+                    c->start_pts = gop.key_pts;
+                av_log(NULL, AV_LOG_DEBUG, "Cached GOP %" PRId64 " of %d frames in %.1fms\n",
+                       gop.key_pts, gop.nb_frames, (av_gettime_relative() - start) / 1000.0);
+                ret = gop_cache_insert(c, &gop);
+            } else if (ret >= 0) {
+                ret = AVERROR_INVALIDDATA;
+            }
+            if (ret < 0) {
+                gop_cache_entry_free(&gop);
+                if (c->abort_request)
+                    break;
+                av_log(NULL, AV_LOG_WARNING, "Could not decode the GOP before pts %" PRId64 ", reverse playback stops there\n", target);
+                c->start_pts = FFMAX(c->start_pts, target + 1);
+            }
+        }
+        if (c->request_pts == target)
+            c->request_pts = AV_NOPTS_VALUE;
+        if (c->prefetch_pts == target)
+            c->prefetch_pts = AV_NOPTS_VALUE;
+        SDL_CondBroadcast(c->cond);
+    }
+    SDL_UnlockMutex(c->mutex);
+    goto end;
+fail:
+    av_log(NULL, AV_LOG_ERROR, "Could not open %s for the GOP cache, reverse playback is unavailable\n", c->url);
+    SDL_LockMutex(c->mutex);
+    c->start_pts = INT64_MAX;
+    SDL_CondBroadcast(c->cond);
+    SDL_UnlockMutex(c->mutex);
+end:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+    avformat_close_input(&ic);
+    return 0;
+}
+
+/* fetch the last frame before cur into frame, waiting for its GOP to be decoded;
+   return 1 on success, 0 once *active is cleared and <0 when aborted */
+static int gop_cache_get_prev(GopCache *c, int64_t cur, AVFrame *frame, const int *active)
+{
+    int ret = 0;
+
+    SDL_LockMutex(c->mutex);
+    while (*active) {
+        GopCacheEntry *gop;
+        int i;
+
+        if (c->abort_request) {
+            ret = AVERROR_EXIT;
+            break;
+        }
+        /* at the beginning, hold the picture until reverse playback is left */
+        if (cur <= c->start_pts) {
+            SDL_CondWait(c->cond, c->mutex);
+            continue;
+        }
+        if ((i = gop_cache_find(c, cur - 1)) < 0) {
+            c->request_pts = cur - 1;
+            SDL_CondBroadcast(c->cond);
+            SDL_CondWait(c->cond, c->mutex);
+            continue;
+        }
+        gop = &c->gops[i];
+        for (i = gop->nb_frames - 1; i >= 0 && gop->frames[i]->pts >= cur; i--)
+            ;
+        if (i < 0) {
+            cur = gop->key_pts;
+            continue;
+        }
+        gop->last_used = ++c->use_clock;
+        ret = av_frame_ref(frame, gop->frames[i]);
+        if (ret >= 0)
+            ret = 1;
+        /* have the GOP before this one decoded while it is played back, if both fit */
+        if (gop->key_pts > c->start_pts && c->bytes + gop->bytes <= c->max_bytes &&
+            c->prefetch_pts != gop->key_pts - 1 && gop_cache_find(c, gop->key_pts - 1) < 0) {
+            c->prefetch_pts = gop->key_pts - 1;
+            SDL_CondBroadcast(c->cond);
+        }
+        break;
+    }
+    SDL_UnlockMutex(c->mutex);
+    return ret;
+}
+
+static void gop_cache_wake(GopCache *c)
+{
+    SDL_LockMutex(c->mutex);
+    SDL_CondBroadcast(c->cond);
+    SDL_UnlockMutex(c->mutex);
+}
+
+static void gop_cache_abort(GopCache *c)
+{
+    SDL_LockMutex(c->mutex);
+    c->abort_request = 1;
+    SDL_CondBroadcast(c->cond);
+    SDL_UnlockMutex(c->mutex);
+}
+
+static void gop_cache_close(GopCache **pc)
+{
+    GopCache *c = *pc;
+    int i;
+
+    if (!c)
+        return;
+    if (c->tid) {
+        gop_cache_abort(c);
+        SDL_WaitThread(c->tid, NULL);
+    }
+    for (i = 0; i < c->nb_gops; i++)
+        gop_cache_entry_free(&c->gops[i]);
+    av_freep(&c->gops);
+    av_freep(&c->url);
+    av_freep(&c->codec_name);
+    if (c->cond)
+        SDL_DestroyCond(c->cond);
+    if (c->mutex)
+        SDL_DestroyMutex(c->mutex);
+    av_freep(pc);
+}
+
+static int gop_cache_open(GopCache **pc, const char *url, const AVInputFormat *iformat,
+                          int stream_index, const char *codec_name, int64_t max_bytes)
+{
+    GopCache *c = static_cast<GopCache *>(av_mallocz(sizeof(*c)));
+
+    if (!c)
+        return AVERROR(ENOMEM);
+    *pc = c;
+    c->max_bytes = max_bytes;
+    c->start_pts = INT64_MIN;
+    c->request_pts = AV_NOPTS_VALUE;
+    c->prefetch_pts = AV_NOPTS_VALUE;
+    c->iformat = iformat;
+    c->stream_index = stream_index;
+    c->url = av_strdup(url);
+    if (codec_name)
+        c->codec_name = av_strdup(codec_name);
+    if (!c->url || (codec_name && !c->codec_name))
+        goto fail;
+    if (!(c->mutex = SDL_CreateMutex()) || !(c->cond = SDL_CreateCond())) {
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex/Cond(): %s\n", SDL_GetError());
+        goto fail;
+    }
+    c->tid = SDL_CreateThread(gop_cache_thread, "gop_cache", c);
+    if (!c->tid) {
+        av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+        goto fail;
+    }
+    return 0;
+fail:
+    gop_cache_close(pc);
+    return AVERROR(ENOMEM);
+}
+
+
+//              ##########################################
+//                          Frame Pool Functions
+//              ##########################################
+
+#define FRAME_POOL_ALIGN 64
+
+static AVBufferRef *frame_pool_alloc(void *opaque, size_t size)
+{
+    FramePool *fp = static_cast<FramePool *>(opaque);
+    AVBufferRef *buf = av_buffer_alloc(size);
+
+    if (buf)
+        fp->nb_buffers++;
+    return buf;
+}
+
+/* lay the planes out the way avcodec_default_get_buffer2() does: dimensions
+   aligned for the codec, then the width widened until every line is aligned */
+static int frame_pool_reinit(FramePool *fp, AVCodecContext *avctx, AVFrame *frame)
+{
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    ptrdiff_t linesizes[4];
+    size_t sizes[4];
+    int w = frame->width, h = frame->height;
+    int linesize[4];
+    int unaligned, ret, i;
+
+    avcodec_align_dimensions2(avctx, &w, &h, linesize_align);
+    do {
+        if ((ret = av_image_fill_linesizes(linesize, static_cast<AVPixelFormat>(frame->format), w)) < 0)
+            return ret;
+        w += w & ~(w - 1);
+        unaligned = 0;
+        for (i = 0; i < 4; i++)
+            unaligned |= linesize[i] % FFMAX(linesize_align[i], FRAME_POOL_ALIGN);
+    } while (unaligned);
+
+    for (i = 0; i < 4; i++)
+        linesizes[i] = linesize[i];
+    if ((ret = av_image_fill_plane_sizes(sizes, static_cast<AVPixelFormat>(frame->format), h, linesizes)) < 0)
+        return ret;
+
+    av_buffer_pool_uninit(&fp->pool);
+    fp->size = 0;
+    for (i = 0; i < 4; i++) {
+        fp->linesize[i] = linesize[i];
+        fp->offset[i] = fp->size;
+        /* decoders may read a little past the last line */
+        if (sizes[i])
+            fp->size += FFALIGN(sizes[i] + 16 + FRAME_POOL_ALIGN - 1, FRAME_POOL_ALIGN);
+    }
+    fp->pool = av_buffer_pool_init2(fp->size, fp, frame_pool_alloc, NULL);
+    if (!fp->pool)
+        return AVERROR(ENOMEM);
+    fp->format = frame->format;
+    fp->width  = frame->width;
+    fp->height = frame->height;
+    av_log(NULL, AV_LOG_VERBOSE, "Frame pool for %dx%d %s, %zu bytes per frame\n",
+           fp->width, fp->height, av_get_pix_fmt_name(static_cast<AVPixelFormat>(fp->format)), fp->size);
+    return 0;
+}
+
+static int frame_pool_get_buffer2(AVCodecContext *avctx, AVFrame *frame, int flags)
+{
+    FramePool *fp = static_cast<FramePool *>(avctx->opaque);
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    AVBufferRef *buf = NULL;
+    int ret = 0, i;
+
+    /* hardware frames and palettes are left to libavcodec */
+    if (!desc || desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL) || avctx->hw_frames_ctx)
+        return avcodec_default_get_buffer2(avctx, frame, flags);
+
+    SDL_LockMutex(fp->mutex);
+    if (!fp->pool || fp->format != frame->format || fp->width != frame->width || fp->height != frame->height)
+        ret = frame_pool_reinit(fp, avctx, frame);
+    if (ret >= 0 && !(buf = av_buffer_pool_get(fp->pool)))
+        ret = AVERROR(ENOMEM);
+    if (buf) {
+        for (i = 0; i < 4; i++) {
+            frame->data[i]     = fp->linesize[i] ? buf->data + fp->offset[i] : NULL;
+            frame->linesize[i] = fp->linesize[i];
+        }
+        fp->nb_frames++;
+    }
+    SDL_UnlockMutex(fp->mutex);
+    if (ret < 0)
+        return ret;
+
+    frame->buf[0] = buf;
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+static void frame_pool_close(FramePool **pfp)
+{
+    FramePool *fp = *pfp;
+
+    if (!fp)
+        return;
+    av_log(NULL, AV_LOG_VERBOSE, "Frame pool served %" PRId64 " frames from %" PRId64 " buffers\n",
+           fp->nb_frames, fp->nb_buffers);
+    /* frames still queued keep the pool alive until they are unreferenced */
+    av_buffer_pool_uninit(&fp->pool);
+    SDL_DestroyMutex(fp->mutex);
+    av_freep(pfp);
+}
+
+static int frame_pool_open(FramePool **pfp)
+{
+    FramePool *fp = static_cast<FramePool *>(av_mallocz(sizeof(*fp)));
+
+    if (!fp)
+        return AVERROR(ENOMEM);
+    fp->format = AV_PIX_FMT_NONE;
+    if (!(fp->mutex = SDL_CreateMutex())) {
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+        av_free(fp);
+        return AVERROR(ENOMEM);
+    }
+    *pfp = fp;
+    return 0;
+}
+
+
+//              ##########################################
+//                         Opt Functions
+//              ##########################################
+
+static int opt_add_vfilter(void *optctx, const char *opt, const char *arg)
+{
+    int ret = GROW_ARRAY(vfilters_list, nb_vfilters);
+    if (ret < 0)
+        return ret;
+
+    vfilters_list[nb_vfilters - 1] = av_strdup(arg);
+    if (!vfilters_list[nb_vfilters - 1])
+        return AVERROR(ENOMEM);
+
+    return 0;
+}
+
+static int opt_width(void *optctx, const char *opt, const char *arg)
+{
+    double num;
+    int ret = parse_number(opt, arg, OPT_TYPE_INT64, 1, INT_MAX, &num);
+    if (ret < 0)
+        return ret;
+
+    screen_width = num;
+    return 0;
+}
+
+static int opt_height(void *optctx, const char *opt, const char *arg)
+{
+    double num;
+    int ret = parse_number(opt, arg, OPT_TYPE_INT64, 1, INT_MAX, &num);
+    if (ret < 0)
+        return ret;
+
+    screen_height = num;
+    return 0;
+}
+
+static int opt_format(void *optctx, const char *opt, const char *arg)
+{
+    file_iformat = av_find_input_format(arg);
+    if (!file_iformat) {
+        av_log(NULL, AV_LOG_FATAL, "Unknown input format: %s\n", arg);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+static int opt_sync(void *optctx, const char *opt, const char *arg)
+{
+    if (!strcmp(arg, "audio"))
+        av_sync_type = AV_SYNC_AUDIO_MASTER;
+    else if (!strcmp(arg, "video"))
+        av_sync_type = AV_SYNC_VIDEO_MASTER;
+    else if (!strcmp(arg, "ext"))
+        av_sync_type = AV_SYNC_EXTERNAL_CLOCK;
+    else {
+        av_log(NULL, AV_LOG_ERROR, "Unknown value for %s: %s\n", opt, arg);
+        exit(1);
+    }
+    return 0;
+}
+
+static int opt_show_mode(void *optctx, const char *opt, const char *arg)
+{
+    show_mode = !strcmp(arg, "video") ? VideoState::SHOW_MODE_VIDEO :
+                !strcmp(arg, "waves") ? VideoState::SHOW_MODE_WAVES :
+                !strcmp(arg, "rdft" ) ? VideoState::SHOW_MODE_RDFT  : VideoState::SHOW_MODE_NONE;
+
+    if (show_mode == VideoState::SHOW_MODE_NONE) {
+        double num;
+        int ret = parse_number(opt, arg, OPT_TYPE_INT, 0, VideoState::SHOW_MODE_NB-1, &num);
+        if (ret < 0)
+            return ret;
+        show_mode = static_cast<VideoState::ShowMode>(num);
+    }
+    return 0;
+}
+
+static int opt_input_file(void *optctx, const char *filename)
+{
+    if (input_filename) {
+        av_log(NULL, AV_LOG_FATAL,
+               "Argument '%s' provided as input filename, but '%s' was already specified.\n",
+                filename, input_filename);
+        return AVERROR(EINVAL);
+    }
+    if (!strcmp(filename, "-"))
+        filename = "fd:";
+    input_filename = av_strdup(filename);
+    if (!input_filename)
+        return AVERROR(ENOMEM);
+
+    return 0;
+}
+
+static int opt_codec(void *optctx, const char *opt, const char *arg)
+{
+   const char *spec = strchr(opt, ':');
+   const char **name;
+   if (!spec) {
+       av_log(NULL, AV_LOG_ERROR,
+              "No media specifier was specified in '%s' in option '%s'\n",
+               arg, opt);
+       return AVERROR(EINVAL);
+   }
+   spec++;
+
+   switch (spec[0]) {
+   case 'a' : name = &audio_codec_name;    break;
+   case 's' : name = &subtitle_codec_name; break;
+   case 'v' : name = &video_codec_name;    break;
+   default:
+       av_log(NULL, AV_LOG_ERROR,
+              "Invalid media specifier '%s' in option '%s'\n", spec, opt);
+       return AVERROR(EINVAL);
+   }
+
+   av_freep(name);
+   *name = av_strdup(arg);
+   return *name ? 0 : AVERROR(ENOMEM);
+}
+
+
+//              ##########################################
+//                        Benchmark Functions
+//              ##########################################
+
+/* CPU time consumed so far by the calling thread, in microseconds */
+static int64_t thread_cpu_time(void)
+{
+#ifdef _WIN32
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+
+    if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time))
+        return 0;
+    return ((((int64_t)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime) +
+            (((int64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime)) / 10;
+#else
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return 0;
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+/* peak resident set size of the process in bytes, 0 if unknown */
+static int64_t peak_rss(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return pmc.PeakWorkingSetSize;
+#else
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru))
+        return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss;
+#else
+    return ru.ru_maxrss * 1024LL;
+#endif
+#endif
+}
+
+static void bench_stage_done(VideoState *is, enum BenchStage stage)
+{
+    is->bench_cpu[stage] += thread_cpu_time();
+}
+
+/* called once every thread of the stream has exited */
+static void benchmark_report(VideoState *is)
+{
+    static const char *const stage_names[BENCH_STAGE_NB] = {
+        "read", "video decode+filter", "audio decode+filter", "video sink", "audio convert",
+    };
+    int64_t end = is->bench_end ? is->bench_end : av_gettime_relative();
+    double elapsed = FFMAX(end - is->bench_start, 1) / 1000000.0;
+    int64_t total = 0;
+    int i;
+
+    av_log(NULL, AV_LOG_INFO, "bench: %" PRId64 " frames, %.2f fps; %" PRId64 " samples, %.0f samples/s; %.3fs wall\n",
+           is->bench_video_frames, is->bench_video_frames / elapsed,
+           is->bench_audio_samples, is->bench_audio_samples / elapsed, elapsed);
+    for (i = 0; i < BENCH_STAGE_NB; i++) {
+        total += is->bench_cpu[i];
+        av_log(NULL, AV_LOG_INFO, "bench: cpu %-20s %8.3fs %6.1f%%\n", stage_names[i],
+               is->bench_cpu[i] / 1000000.0, 100.0 * is->bench_cpu[i] / 1000000.0 / elapsed);
+    }
+    av_log(NULL, AV_LOG_INFO, "bench: cpu %-20s %8.3fs %6.1f%%\n", "total",
+           total / 1000000.0, 100.0 * total / 1000000.0 / elapsed);
+    av_log(NULL, AV_LOG_INFO, "bench: peak videoq %d pkts %d KB, audioq %d pkts %d KB, pictq %d/%d, sampq %d/%d\n",
+           is->videoq.peak_nb_packets, is->videoq.peak_size / 1024,
+           is->audioq.peak_nb_packets, is->audioq.peak_size / 1024,
+           is->pictq.peak_size, is->pictq.max_size, is->sampq.peak_size, is->sampq.max_size);
+    av_log(NULL, AV_LOG_INFO, "bench: peak rss %" PRId64 " KB\n", peak_rss() / 1024);
+}
+
+
+//              ##########################################
+//                        Audio Gain Functions
+//              ##########################################
+
+/* dst[i] = src[i] * (gain + i * step), saturated for integer samples */
+typedef void (*AudioGainFunc)(uint8_t *dst, const uint8_t *src, int nb_samples, float gain, float step);
+
+static void audio_gain_s16_c(uint8_t *dst, const uint8_t *src, int nb_samples, float gain, float step)
+{
+    int16_t *d = (int16_t *)dst;
+    const int16_t *s = (const int16_t *)src;
+    int i;
+
+    for (i = 0; i < nb_samples; i++)
+        d[i] = av_clip_int16(lrintf(s[i] * (gain + i * step)));
+}
+
+static void audio_gain_flt_c(uint8_t *dst, const uint8_t *src, int nb_samples, float gain, float step)
+{
+    float *d = (float *)dst;
+    const float *s = (const float *)src;
+    int i;
+
+    for (i = 0; i < nb_samples; i++)
+        d[i] = s[i] * (gain + i * step);
+}
+
+#if HAVE_X86_GAIN
+__attribute__((target("sse2")))
+static void audio_gain_s16_sse2(uint8_t *dst, const uint8_t *src, int nb_samples, float gain, float step)
+{
+    __m128 g0 = _mm_setr_ps(gain, gain + step, gain + 2 * step, gain + 3 * step);
+    __m128 g1 = _mm_add_ps(g0, _mm_set1_ps(4 * step));
+    __m128 inc = _mm_set1_ps(8 * step);
+    int i;
+
+    for (i = 0; i + 8 <= nb_samples; i += 8) {
+        __m128i v  = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), g0));
+        hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), g1));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_packs_epi32(lo, hi));
+        g0 = _mm_add_ps(g0, inc);
+        g1 = _mm_add_ps(g1, inc);
+    }
+    audio_gain_s16_c(dst + 2 * i, src + 2 * i, nb_samples - i, gain + i * step, step);
+}
+
+__attribute__((target("sse2")))
+static void audio_gain_flt_sse2(uint8_t *dst, const uint8_t *src, int nb_samples, float gain, float step)
+{
+    __m128 g = _mm_setr_ps(gain, gain + step, gain + 2 * step, gain + 3 * step);
+    __m128 inc = _mm_set1_ps(4 * step);
+    int i;
+
+    for (i = 0; i + 4 <= nb_samples; i += 4) {
+        _mm_storeu_ps((float *)(dst + 4 * i), _mm_mul_ps(_mm_loadu_ps((const float *)(src + 4 * i)), g));
+        g = _mm_add_ps(g, inc);
+    }
+    audio_gain_flt_c(dst + 4 * i, src + 4 * i, nb_samples - i, gain + i * step, step);
+}
+
+__attribute__((target("avx2")))
+static void audio_gain_s16_avx2(uint8_t *dst, const uint8_t *src, int nb_samples, float gain, float step)
+{
+    __m256 g0 = _mm256_setr_ps(gain,            gain + step,     gain + 2 * step, gain + 3 * step,
+                               gain + 4 * step, gain + 5 * step, gain + 6 * step, gain + 7 * step);
+    __m256 g1 = _mm256_add_ps(g0, _mm256_set1_ps(8 * step));
+    __m256 inc = _mm256_set1_ps(16 * step);
+    int i;
+
+    for (i = 0; i + 16 <= nb_samples; i += 16) {
+        __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + 2 * i)));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + 2 * i + 16)));
+        lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(lo), g0));
+        hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(hi), g1));
+        /* packs works within 128-bit lanes, put the quarters back in order */
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i),
+                            _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0)));
+        g0 = _mm256_add_ps(g0, inc);
+        g1 = _mm256_add_ps(g1, inc);
+    }
+    audio_gain_s16_c(dst + 2 * i, src + 2 * i, nb_samples - i, gain + i * step, step);
+}
+
+__attribute__((target("avx2")))
+static void audio_gain_flt_avx2(uint8_t *dst, const uint8_t *src, int nb_samples, float gain, float step)
+{
+    __m256 g = _mm256_setr_ps(gain,            gain + step,     gain + 2 * step, gain + 3 * step,
+                              gain + 4 * step, gain + 5 * step, gain + 6 * step, gain + 7 * step);
+    __m256 inc = _mm256_set1_ps(8 * step);
+    int i;
+
+    for (i = 0; i + 8 <= nb_samples; i += 8) {
+        _mm256_storeu_ps((float *)(dst + 4 * i), _mm256_mul_ps(_mm256_loadu_ps((const float *)(src + 4 * i)), g));
+        g = _mm256_add_ps(g, inc);
+    }
+    audio_gain_flt_c(dst + 4 * i, src + 4 * i, nb_samples - i, gain + i * step, step);
+}
+#endif
+
+#if HAVE_NEON_GAIN
+static void audio_gain_s16_neon(uint8_t *dst, const uint8_t *src, int nb_samples, float gain, float step)
+{
+    const float init[4] = { gain, gain + step, gain + 2 * step, gain + 3 * step };
+    float32x4_t g0 = vld1q_f32(init);
+    float32x4_t g1 = vaddq_f32(g0, vdupq_n_f32(4 * step));
+    float32x4_t inc = vdupq_n_f32(8 * step);
+    int i;
+
+    for (i = 0; i + 8 <= nb_samples; i += 8) {
+        int16x8_t v = vld1q_s16((const int16_t *)(src + 2 * i));
+        int32x4_t lo = vcvtnq_s32_f32(vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), g0));
+        int32x4_t hi = vcvtnq_s32_f32(vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), g1));
+        vst1q_s16((int16_t *)(dst + 2 * i), vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+        g0 = vaddq_f32(g0, inc);
+        g1 = vaddq_f32(g1, inc);
+    }
+    audio_gain_s16_c(dst + 2 * i, src + 2 * i, nb_samples - i, gain + i * step, step);
+}
+
+static void audio_gain_flt_neon(uint8_t *dst, const uint8_t *src, int nb_samples, float gain, float step)
+{
+    const float init[4] = { gain, gain + step, gain + 2 * step, gain + 3 * step };
+    float32x4_t g = vld1q_f32(init);
+    float32x4_t inc = vdupq_n_f32(4 * step);
+    int i;
+
+    for (i = 0; i + 4 <= nb_samples; i += 4) {
+        vst1q_f32((float *)(dst + 4 * i), vmulq_f32(vld1q_f32((const float *)(src + 4 * i)), g));
+        g = vaddq_f32(g, inc);
+    }
+    audio_gain_flt_c(dst + 4 * i, src + 4 * i, nb_samples - i, gain + i * step, step);
+}
+#endif
+
+static AudioGainFunc audio_gain_s16 = audio_gain_s16_c;
+static AudioGainFunc audio_gain_flt = audio_gain_flt_c;
+
+/* pick the widest kernels the CPU runs */
+static void audio_gain_init(void)
+{
+    int av_unused cpu_flags = av_get_cpu_flags();
+
+#if HAVE_X86_GAIN
+    if (cpu_flags & AV_CPU_FLAG_SSE2) {
+        audio_gain_s16 = audio_gain_s16_sse2;
+        audio_gain_flt = audio_gain_flt_sse2;
+    }
+    if (cpu_flags & AV_CPU_FLAG_AVX2) {
+        audio_gain_s16 = audio_gain_s16_avx2;
+        audio_gain_flt = audio_gain_flt_avx2;
+    }
+#endif
+#if HAVE_NEON_GAIN
+    if (cpu_flags & AV_CPU_FLAG_NEON) {
+        audio_gain_s16 = audio_gain_s16_neon;
+        audio_gain_flt = audio_gain_flt_neon;
+    }
+#endif
+}
+
+/* copy len bytes of samples in the output format to the device buffer,
+   moving the gain towards the current volume by at most one full swing per
+   AUDIO_GAIN_RAMP */
+static void audio_gain_apply(VideoState *is, uint8_t *dst, const uint8_t *src, int len)
+{
+    AudioGainFunc gain_func = is->audio_tgt.fmt == AV_SAMPLE_FMT_FLT ? audio_gain_flt : audio_gain_s16;
+    int nb_samples = len / av_get_bytes_per_sample(is->audio_tgt.fmt);
+    float target = is->muted ? 0.0f : is->audio_volume / (float)SDL_MIX_MAXVOLUME;
+    float max_step, step;
+
+    if (is->audio_gain == target) {
+        if (target == 1.0f)
+            memcpy(dst, src, len);
+        else if (target == 0.0f)
+            memset(dst, 0, len);
+        else
+            gain_func(dst, src, nb_samples, target, 0.0f);
+        return;
+    }
+
+    max_step = 1.0f / (AUDIO_GAIN_RAMP * is->audio_tgt.freq * is->audio_tgt.ch_layout.nb_channels);
+    step = av_clipf((target - is->audio_gain) / nb_samples, -max_step, max_step);
+    gain_func(dst, src, nb_samples, is->audio_gain, step);
+    if (fabsf(target - is->audio_gain) <= max_step * nb_samples)
+        is->audio_gain = target;
+    else
+        is->audio_gain += step * nb_samples;
+}
+
+/* -gain_bench: time the volume path the audio callback used to take against
+   the C and the dispatched kernels, with and without a ramp */
+static void audio_gain_benchmark(void)
+{
+    enum { NB_SAMPLES = 2 * 48000, NB_RUNS = 200 };
+    int16_t *src16 = static_cast<int16_t *>(av_malloc(NB_SAMPLES * sizeof(*src16)));
+    int16_t *dst16 = static_cast<int16_t *>(av_malloc(NB_SAMPLES * sizeof(*dst16)));
+    float *srcf = static_cast<float *>(av_malloc(NB_SAMPLES * sizeof(*srcf)));
+    float *dstf = static_cast<float *>(av_malloc(NB_SAMPLES * sizeof(*dstf)));
+    const struct {
+        const char *name;
+        AudioGainFunc func;
+        int flt;
+    } kernels[] = {
+        { "s16 c",   audio_gain_s16_c, 0 },
+        { "s16 cpu", audio_gain_s16,   0 },
+        { "flt c",   audio_gain_flt_c, 1 },
+        { "flt cpu", audio_gain_flt,   1 },
+    };
+    int64_t start, mix_time;
+    unsigned seed = 1;
+    int i, j, ramp;
+
+    if (!src16 || !dst16 || !srcf || !dstf) {
+        av_log(NULL, AV_LOG_FATAL, "Could not allocate the benchmark buffers\n");
+        goto end;
+    }
+    for (i = 0; i < NB_SAMPLES; i++) {
+        seed = seed * 1664525 + 1013904223;
+        src16[i] = seed >> 16;
+        srcf[i] = src16[i] / 32768.0f;
+    }
+
+    start = av_gettime_relative();
+    for (j = 0; j < NB_RUNS; j++) {
+        memset(dst16, 0, NB_SAMPLES * sizeof(*dst16));
+        SDL_MixAudioFormat((Uint8 *)dst16, (const Uint8 *)src16, AUDIO_S16SYS, NB_SAMPLES * sizeof(*dst16), SDL_MIX_MAXVOLUME / 2);
+    }
+    mix_time = FFMAX(av_gettime_relative() - start, 1);
+    av_log(NULL, AV_LOG_INFO, "gain bench: %-24s %7.3f ns/sample\n", "s16 SDL_MixAudioFormat",
+           mix_time * 1000.0 / NB_RUNS / NB_SAMPLES);
+
+    for (ramp = 0; ramp < 2; ramp++) {
+        for (i = 0; i < (int)FF_ARRAY_ELEMS(kernels); i++) {
+            float step = ramp ? -0.5f / NB_SAMPLES : 0.0f;
+            int64_t t;
+
+            start = av_gettime_relative();
+            for (j = 0; j < NB_RUNS; j++)
+                kernels[i].func(kernels[i].flt ? (uint8_t *)dstf : (uint8_t *)dst16,
+                                kernels[i].flt ? (const uint8_t *)srcf : (const uint8_t *)src16,
+                                NB_SAMPLES, ramp ? 1.0f : 0.5f, step);
+            t = FFMAX(av_gettime_relative() - start, 1);
+            av_log(NULL, AV_LOG_INFO, "gain bench: %-9s%-15s %7.3f ns/sample, %5.2fx SDL_MixAudioFormat\n",
+                   kernels[i].name, ramp ? " ramp" : "", t * 1000.0 / NB_RUNS / NB_SAMPLES, (double)mix_time / t);
+        }
+    }
+end:
+    av_free(src16);
+    av_free(dst16);
+    av_free(srcf);
+    av_free(dstf);
+}
+
+
+//              ##########################################
+//                         PCM Ring Functions
+//              ##########################################
+
+static int pcm_ring_init(PcmRing *r, unsigned min_size)
+{
+    r->size = 1U << (av_log2(FFMAX(min_size, 2) - 1) + 1);
+    r->data = static_cast<uint8_t *>(av_malloc(r->size));
+    if (!r->data)
+        return AVERROR(ENOMEM);
+    r->windex.store(0, std::memory_order_relaxed);
+    r->rindex.store(0, std::memory_order_relaxed);
+    r->mark_windex.store(0, std::memory_order_relaxed);
+    r->mark_rindex.store(0, std::memory_order_relaxed);
+    r->last_mark.end = 0;
+    r->last_mark.clock = NAN;
+    r->last_mark.tempo = 1.0;
+    r->last_mark.serial = -1;
+    return 0;
+}
+
+static void pcm_ring_free(PcmRing *r)
+{
+    av_freep(&r->data);
+    r->size = 0;
+}
+
+/* render thread: copy as much of src as fits, return the bytes copied */
+static int pcm_ring_write(PcmRing *r, const uint8_t *src, int len)
+{
+    unsigned windex = r->windex.load(std::memory_order_relaxed);
+    unsigned space = r->size - (windex - r->rindex.load(std::memory_order_acquire));
+    unsigned off = windex & (r->size - 1);
+    unsigned len1;
+
+    len = FFMIN((unsigned)len, space);
+    len1 = FFMIN((unsigned)len, r->size - off);
+    memcpy(r->data + off, src, len1);
+    memcpy(r->data, src + len1, len - len1);
+    r->windex.store(windex + len, std::memory_order_release);
+    return len;
+}
+
+/* render thread: tag everything written so far, AVERROR(EAGAIN) if the marks are full */
+static int pcm_ring_mark(PcmRing *r, double clock, double tempo, int serial)
+{
+    unsigned mark_windex = r->mark_windex.load(std::memory_order_relaxed);
+    PcmMark *m;
+
+    if (mark_windex - r->mark_rindex.load(std::memory_order_acquire) >= PCM_RING_MARKS)
+        return AVERROR(EAGAIN);
+    m = &r->marks[mark_windex & (PCM_RING_MARKS - 1)];
+    m->end = r->windex.load(std::memory_order_relaxed);
+    m->clock = clock;
+    m->tempo = tempo;
+    m->serial = serial;
+    r->mark_windex.store(mark_windex + 1, std::memory_order_release);
+    return 0;
+}
+
+/* callback: the contiguous readable bytes, at most len */
+static int pcm_ring_peek(PcmRing *r, const uint8_t **data, int len)
+{
+    unsigned rindex = r->rindex.load(std::memory_order_relaxed);
+    unsigned avail = r->windex.load(std::memory_order_acquire) - rindex;
+    unsigned off = rindex & (r->size - 1);
+
+    *data = r->data + off;
+    return FFMIN(FFMIN((unsigned)len, avail), r->size - off);
+}
+
+/* callback: release len bytes and the marks played past */
+static void pcm_ring_consume(PcmRing *r, int len)
+{
+    unsigned rindex = r->rindex.load(std::memory_order_relaxed) + len;
+    unsigned mark_rindex = r->mark_rindex.load(std::memory_order_relaxed);
+    unsigned mark_windex = r->mark_windex.load(std::memory_order_acquire);
+
+    r->rindex.store(rindex, std::memory_order_release);
+    while (mark_rindex != mark_windex &&
+           (int)(r->marks[mark_rindex & (PCM_RING_MARKS - 1)].end - rindex) <= 0)
+        r->last_mark = r->marks[mark_rindex++ & (PCM_RING_MARKS - 1)];
+    r->mark_rindex.store(mark_rindex, std::memory_order_release);
+}
+
+/* callback: drop the frames rendered for another packet serial, e.g. before a seek */
+static void pcm_ring_skip_stale(PcmRing *r, int serial)
+{
+    unsigned mark_rindex = r->mark_rindex.load(std::memory_order_relaxed);
+    unsigned mark_windex = r->mark_windex.load(std::memory_order_acquire);
+
+    while (mark_rindex != mark_windex) {
+        PcmMark *m = &r->marks[mark_rindex & (PCM_RING_MARKS - 1)];
+        if (m->serial == serial)
+            break;
+        r->last_mark = *m;
+        r->rindex.store(m->end, std::memory_order_release);
+        mark_rindex++;
+    }
+    r->mark_rindex.store(mark_rindex, std::memory_order_release);
+}
+
+/* callback: the mark of the frame being played and how many of its bytes are
+   still in the ring */
+static const PcmMark *pcm_ring_current_mark(PcmRing *r, int *pending)
 {
-    double num;
-    int ret = parse_number(opt, arg, OPT_TYPE_INT64, 1, INT_MAX, &num);
-    if (ret < 0)
-        return ret;
+    unsigned rindex = r->rindex.load(std::memory_order_relaxed);
+    unsigned mark_rindex = r->mark_rindex.load(std::memory_order_relaxed);
 
-    screen_width = num;
-    return 0;
+    if (mark_rindex != r->mark_windex.load(std::memory_order_acquire)) {
+        const PcmMark *m = &r->marks[mark_rindex & (PCM_RING_MARKS - 1)];
+        *pending = m->end - rindex;
+        return m;
+    }
+    *pending = 0;
+    return &r->last_mark;
 }
 
-static int opt_height(void *optctx, const char *opt, const char *arg)
+
+//              ##########################################
+//                        Live Latency Functions
+//              ##########################################
+
+/* read_thread: measure the interarrival jitter of the live stream's packets */
+static void live_packet_arrived(VideoState *is, const AVPacket *pkt)
 {
-    double num;
-    int ret = parse_number(opt, arg, OPT_TYPE_INT64, 1, INT_MAX, &num);
-    if (ret < 0)
-        return ret;
+    int64_t now = av_gettime_relative();
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    double t, d;
 
-    screen_height = num;
-    return 0;
+    if (!is->live || pkt->stream_index != is->live_stream || ts == AV_NOPTS_VALUE)
+        return;
+    t = ts * av_q2d(is->ic->streams[pkt->stream_index]->time_base);
+    if (is->live_last_arrival) {
+        d = (now - is->live_last_arrival) / 1000000.0 - (t - is->live_last_ts);
+        /* timestamp jumps are no jitter */
+        if (fabs(d) < 1.0) {
+            double jitter = is->live_jitter.load(std::memory_order_relaxed);
+            is->live_jitter.store(jitter + (fabs(d) - jitter) / 16, std::memory_order_relaxed);
+        }
+    }
+    is->live_last_arrival = now;
+    is->live_last_ts = t;
+    is->live_newest_ts.store(t, std::memory_order_relaxed);
 }
 
-static int opt_format(void *optctx, const char *opt, const char *arg)
+/* Size the jitter buffer from the measured jitter and ask audio_thread for the
+ * tempo that brings what is buffered back to it. The glass-to-glass latency is
+ * known when the sender reports the capture time (RTCP), as start_time_realtime. */
+static void live_update(VideoState *is)
 {
-    file_iformat = av_find_input_format(arg);
-    if (!file_iformat) {
-        av_log(NULL, AV_LOG_FATAL, "Unknown input format: %s\n", arg);
-        return AVERROR(EINVAL);
+    double clock = get_master_clock(is);
+    double newest = is->live_newest_ts.load(std::memory_order_relaxed);
+    double err, tempo;
+
+    if (isnan(clock) || isnan(newest))
+        return;
+    is->live_target = av_clipd(LIVE_JITTER_MULT * is->live_jitter.load(std::memory_order_relaxed), LIVE_MIN_BUFFER,
+                               FFMAX(live_latency / 1000.0, LIVE_MIN_BUFFER));
+    is->live_buffered = newest - clock;
+    err = is->live_buffered - is->live_target;
+    tempo = fabs(err) < LIVE_DEADBAND ? 1.0 : 1.0 + av_clipd(err * LIVE_TEMPO_GAIN, -LIVE_MAX_TEMPO_DELTA, LIVE_MAX_TEMPO_DELTA);
+    /* in steps of 0.5%, atempo is not retuned for every frame */
+    is->live_tempo.store(round(tempo * 200.0) / 200.0, std::memory_order_relaxed);
+    is->live_buffered_sum += is->live_buffered;
+    is->live_buffered_nb++;
+
+    /* start_time_realtime is the capture time of start_time, not of pts 0 */
+    if (is->ic->start_time_realtime != AV_NOPTS_VALUE) {
+        double start = is->ic->start_time != AV_NOPTS_VALUE ? is->ic->start_time / 1000000.0 : 0;
+        is->live_g2g = (av_gettime() - is->ic->start_time_realtime) / 1000000.0 - (clock - start);
+        is->live_g2g_sum += is->live_g2g;
+        is->live_g2g_nb++;
     }
-    return 0;
 }
 
-static int opt_sync(void *optctx, const char *opt, const char *arg)
+static void live_report(VideoState *is)
 {
-    if (!strcmp(arg, "audio"))
-        av_sync_type = AV_SYNC_AUDIO_MASTER;
-    else if (!strcmp(arg, "video"))
-        av_sync_type = AV_SYNC_VIDEO_MASTER;
-    else if (!strcmp(arg, "ext"))
-        av_sync_type = AV_SYNC_EXTERNAL_CLOCK;
-    else {
-        av_log(NULL, AV_LOG_ERROR, "Unknown value for %s: %s\n", opt, arg);
-        exit(1);
-    }
-    return 0;
+    if (!is->live_buffered_nb)
+        return;
+    av_log(NULL, AV_LOG_INFO, "live: %.0f ms buffered on average for a %d ms target, %.1f ms jitter",
+           is->live_buffered_sum * 1000.0 / is->live_buffered_nb, live_latency, is->live_jitter.load() * 1000.0);
+    if (is->live_g2g_nb)
+        av_log(NULL, AV_LOG_INFO, ", %.0f ms glass-to-glass\n", is->live_g2g_sum * 1000.0 / is->live_g2g_nb);
+    else
+        av_log(NULL, AV_LOG_INFO, ", glass-to-glass unknown without sender capture times\n");
 }
 
-static int opt_show_mode(void *optctx, const char *opt, const char *arg)
+
+//              ##########################################
+//                         Degrade Functions
+//              ##########################################
+
+/* remember the codec settings degrade_apply() starts from. lowres is not one
+   of the steps: decoders size their buffers and pick their IDCT from it when
+   opened, changing it on an open codec corrupts the output or overflows. */
+static void degrade_init(Degrade *g, const AVCodecContext *avctx)
 {
-    show_mode = !strcmp(arg, "video") ? VideoState::SHOW_MODE_VIDEO :
-                !strcmp(arg, "waves") ? VideoState::SHOW_MODE_WAVES :
-                !strcmp(arg, "rdft" ) ? VideoState::SHOW_MODE_RDFT  : VideoState::SHOW_MODE_NONE;
+    memset(g, 0, sizeof(*g));
+    /* a benchmark measures the full decode, never trade quality for speed there */
+    if (!autodegrade || benchmark)
+        return;
+    g->skip_loop_filter = avctx->skip_loop_filter;
+    g->flags2 = avctx->flags2;
+    g->max_level = DEGRADE_FAST;
+    g->recover_windows = DEGRADE_RECOVER_MIN;
+    g->window_start = av_gettime_relative();
+}
 
-    if (show_mode == VideoState::SHOW_MODE_NONE) {
-        double num;
-        int ret = parse_number(opt, arg, OPT_TYPE_INT, 0, VideoState::SHOW_MODE_NB-1, &num);
-        if (ret < 0)
-            return ret;
-        show_mode = static_cast<VideoState::ShowMode>(num);
-    }
-    return 0;
+static void degrade_apply(Decoder *d, const Degrade *g)
+{
+    AVCodecContext *avctx = d->avctx;
+
+    avctx->skip_loop_filter = g->level >= DEGRADE_LOOP_FILTER_ALL    ? AVDISCARD_ALL :
+                              g->level >= DEGRADE_LOOP_FILTER_NONREF ? FFMAX(g->skip_loop_filter, AVDISCARD_NONREF) :
+                                                                       g->skip_loop_filter;
+    d->degrade_skip_frame = g->level >= DEGRADE_SKIP_NONREF ? AVDISCARD_NONREF : AVDISCARD_NONE;
+    avctx->flags2 = g->level >= DEGRADE_FAST ? g->flags2 | AV_CODEC_FLAG2_FAST : g->flags2;
 }
 
-static int opt_input_file(void *optctx, const char *filename)
+/* video_thread: once per window, trade picture quality for decode time while
+ * frames are dropped, before they are decoded rather than after. The load is
+ * the share of wall time spent in the codec, so it does not depend on how
+ * many frames are skipped. Stepping down again is held off longer each time
+ * the decoder relapses shortly after. */
+static void degrade_update(VideoState *is)
 {
-    if (input_filename) {
-        av_log(NULL, AV_LOG_FATAL,
-               "Argument '%s' provided as input filename, but '%s' was already specified.\n",
-                filename, input_filename);
-        return AVERROR(EINVAL);
+    static const char *const names[] = { "none", "skip_loop_filter=nonref", "skip_loop_filter=all",
+                                         "skip_frame=nonref", "flags2=+fast" };
+    Degrade *g = &is->degrade;
+    Decoder *d = &is->viddec;
+    int64_t now = av_gettime_relative();
+    int64_t frames;
+    int drops, level = g->level;
+    double load;
+
+    if (!g->max_level || now - g->window_start < DEGRADE_WINDOW)
+        return;
+    frames = d->nb_frames - g->window_frames;
+    drops = is->frame_drops_early + is->frame_drops_late - g->window_drops;
+    load = (d->codec_time - g->window_codec_time) / (double)(now - g->window_start);
+
+    if (!is->paused && frames >= DEGRADE_MIN_FRAMES) {
+        if (drops > DEGRADE_DROP_RATIO * frames || load > DEGRADE_LOAD_HIGH) {
+            g->calm_windows = 0;
+            if (level < g->max_level) {
+                level++;
+                if (g->last_down && now - g->last_down < g->recover_windows * (int64_t)DEGRADE_WINDOW)
+                    g->recover_windows = FFMIN(g->recover_windows * 2, DEGRADE_RECOVER_MAX);
+            }
+        } else if (!drops && load < DEGRADE_LOAD_LOW && level > DEGRADE_NONE) {
+            if (++g->calm_windows >= g->recover_windows) {
+                level--;
+                g->calm_windows = 0;
+                g->last_down = now;
+            }
+        } else {
+            g->calm_windows = 0;
+        }
     }
-    if (!strcmp(filename, "-"))
-        filename = "fd:";
-    input_filename = av_strdup(filename);
-    if (!input_filename)
-        return AVERROR(ENOMEM);
 
-    return 0;
+    g->window_start = now;
+    g->window_frames = d->nb_frames;
+    g->window_codec_time = d->codec_time;
+    g->window_drops = is->frame_drops_early + is->frame_drops_late;
+
+    if (level != g->level) {
+        av_log(NULL, AV_LOG_VERBOSE, "Video decoder %s to %s: %d drops in %" PRId64 " frames, %.0f%% load\n",
+               level > g->level ? "degraded" : "restored", names[level], drops, frames, load * 100.0);
+        g->level = level;
+        g->peak = FFMAX(g->peak, level);
+        g->changes++;
+        degrade_apply(d, g);
+    }
 }
 
-static int opt_codec(void *optctx, const char *opt, const char *arg)
+static void degrade_report(VideoState *is)
 {
-   const char *spec = strchr(opt, ':');
-   const char **name;
-   if (!spec) {
-       av_log(NULL, AV_LOG_ERROR,
-              "No media specifier was specified in '%s' in option '%s'\n",
-               arg, opt);
-       return AVERROR(EINVAL);
-   }
-   spec++;
-
-   switch (spec[0]) {
-   case 'a' : name = &audio_codec_name;    break;
-   case 's' : name = &subtitle_codec_name; break;
-   case 'v' : name = &video_codec_name;    break;
-   default:
-       av_log(NULL, AV_LOG_ERROR,
-              "Invalid media specifier '%s' in option '%s'\n", spec, opt);
-       return AVERROR(EINVAL);
-   }
+    const Degrade *g = &is->degrade;
 
-   av_freep(name);
-   *name = av_strdup(arg);
-   return *name ? 0 : AVERROR(ENOMEM);
+    if (g->changes)
+        av_log(NULL, AV_LOG_VERBOSE, "decoder degradation: %d changes, up to level %d of %d, ending at %d\n",
+               g->changes, g->peak, g->max_level, g->level);
 }
 
 
@@ -900,8 +3435,10 @@ static void stream_seek(VideoState *is, int64_t pos, int64_t rel, int by_bytes)
         is->seek_flags &= ~AVSEEK_FLAG_BYTE;
         if (by_bytes)
             is->seek_flags |= AVSEEK_FLAG_BYTE;
+        /* reverse playback continues backwards from the new position */
+        is->reverse_seek_pts = by_bytes ? NAN : pos / (double)AV_TIME_BASE;
         is->seek_req = 1;
-        SDL_CondSignal(is->continue_read_thread);
+        read_wakeup_signal(&is->continue_read_thread);
     }
 }
 
@@ -930,9 +3467,17 @@ static void stream_component_close(VideoState *is, int stream_index)
 
     switch (codecpar->codec_type) {
     case AVMEDIA_TYPE_AUDIO:
+        is->audio_render_abort = 1;
         decoder_abort(&is->auddec, &is->sampq);
+        if (is->audio_render_tid) {
+            SDL_WaitThread(is->audio_render_tid, NULL);
+            is->audio_render_tid = NULL;
+        }
         SDL_CloseAudioDevice(audio_dev);
         decoder_destroy(&is->auddec);
+        if (is->audio_underruns)
+            av_log(NULL, AV_LOG_WARNING, "audio: %d underruns\n", is->audio_underruns);
+        pcm_ring_free(&is->pcm_ring);
         swr_free(&is->swr_ctx);
         av_freep(&is->audio_buf1);
         is->audio_buf1_size = 0;
@@ -947,8 +3492,14 @@ static void stream_component_close(VideoState *is, int stream_index)
         }
         break;
     case AVMEDIA_TYPE_VIDEO:
+        /* video_thread may be waiting on the GOP cache */
+        if (is->gop_cache)
+            gop_cache_abort(is->gop_cache);
         decoder_abort(&is->viddec, &is->pictq);
         decoder_destroy(&is->viddec);
+        frame_pool_close(&is->frame_pool);
+        gop_cache_close(&is->gop_cache);
+        is->reverse = 0;
         break;
     case AVMEDIA_TYPE_SUBTITLE:
         decoder_abort(&is->subdec, &is->subpq);
@@ -984,14 +3535,21 @@ static void frame_queue_unref_item(Frame *vp)
 }
 
 
-static void frame_queue_destroy(FrameQueue *f)
+static void frame_queue_free_slots(FrameQueue *f)
 {
     int i;
-    for (i = 0; i < f->max_size; i++) {
+    for (i = 0; i < f->capacity; i++) {
         Frame *vp = &f->queue[i];
         frame_queue_unref_item(vp);
         av_frame_free(&vp->frame);
     }
+    av_freep(&f->queue);
+    f->capacity = 0;
+}
+
+static void frame_queue_destroy(FrameQueue *f)
+{
+    frame_queue_free_slots(f);
     SDL_DestroyMutex(f->mutex);
     SDL_DestroyCond(f->cond);
 }
@@ -1001,7 +3559,20 @@ static void stream_close(VideoState *is)
 {
     /* XXX: use a special url_shutdown call to abort parse cleanly */
     is->abort_request = 1;
+    read_wakeup_signal(&is->continue_read_thread);
+    if (is->readahead)
+        readahead_abort(is->readahead);
+    /* read_thread may be sleeping on a full packet ring */
+    packet_queue_abort(&is->videoq);
+    packet_queue_abort(&is->audioq);
+    packet_queue_abort(&is->subtitleq);
+    /* the -benchmark sinks sleep on the frame queues */
+    frame_queue_signal(&is->pictq);
+    frame_queue_signal(&is->sampq);
+    /* read_thread starts the sinks, join it first so that both are known */
     SDL_WaitThread(is->read_tid, NULL);
+    SDL_WaitThread(is->video_sink_tid, NULL);
+    SDL_WaitThread(is->audio_sink_tid, NULL);
 
     /* close each stream */
     if (is->audio_stream >= 0)
@@ -1012,7 +3583,33 @@ static void stream_close(VideoState *is)
         stream_component_close(is, is->subtitle_stream);
 
     avformat_close_input(&is->ic);
-
+    readahead_close(&is->readahead);
+    mapped_input_close(&is->mapped_input);
+    keyframe_index_close(&is->kf_index);
+
+    packet_queue_log_pool(&is->videoq, "videoq");
+    packet_queue_log_pool(&is->audioq, "audioq");
+    packet_queue_log_pool(&is->subtitleq, "subtitleq");
+    if (is->present_jitter_nb)
+        av_log(NULL, AV_LOG_VERBOSE, "present jitter: %" PRId64 " pictures, %.2f ms mean, %.2f ms max\n",
+               is->present_jitter_nb, is->present_jitter_sum * 1000.0 / is->present_jitter_nb,
+               is->present_jitter_max * 1000.0);
+    if (is->upload_nb)
+        av_log(NULL, AV_LOG_VERBOSE, "upload: %" PRId64 " pictures (%" PRId64 " ahead of display), %.2f ms mean\n",
+               is->upload_nb, is->upload_ahead_nb, is->upload_time_sum * 1000.0 / is->upload_nb);
+    if (is->present_nb)
+        av_log(NULL, AV_LOG_VERBOSE, "present: %" PRId64 " frames, %.2f ms mean\n",
+               is->present_nb, is->present_time_sum * 1000.0 / is->present_nb);
+    if (is->live)
+        live_report(is);
+    degrade_report(is);
+    if (is->viddec.catch_ups)
+        av_log(NULL, AV_LOG_VERBOSE, "catch-up: %d times, %.2f s in total, %" PRId64 " packets skipped before decoding\n",
+               is->viddec.catch_ups,
+               (is->viddec.catch_up_time + (is->viddec.catch_up ? av_gettime_relative() - is->viddec.catch_up_start : 0)) / 1000000.0,
+               is->viddec.catch_up_skipped);
+    if (benchmark)
+        benchmark_report(is);
     packet_queue_destroy(&is->videoq);
     packet_queue_destroy(&is->audioq);
     packet_queue_destroy(&is->subtitleq);
@@ -1021,13 +3618,14 @@ static void stream_close(VideoState *is)
     frame_queue_destroy(&is->pictq);
     frame_queue_destroy(&is->sampq);
     frame_queue_destroy(&is->subpq);
-    SDL_DestroyCond(is->continue_read_thread);
+    read_wakeup_destroy(&is->continue_read_thread);
     sws_freeContext(is->sub_convert_ctx);
     av_free(is->filename);
     if (is->vis_texture)
         SDL_DestroyTexture(is->vis_texture);
-    if (is->vid_texture)
-        SDL_DestroyTexture(is->vid_texture);
+    for (int i = 0; i < VIDEO_TEXTURE_RING; i++)
+        if (is->vid_textures[i])
+            SDL_DestroyTexture(is->vid_textures[i]);
     if (is->sub_texture)
         SDL_DestroyTexture(is->sub_texture);
     av_free(is);
@@ -1115,7 +3713,7 @@ fail:
 
 static int configure_audio_filters(VideoState *is, const char *afilters, int force_output_format)
 {
-    AVFilterContext *filt_asrc = NULL, *filt_asink = NULL;
+    AVFilterContext *filt_asrc = NULL, *filt_asink = NULL, *filt_atempo = NULL;
     char aresample_swr_opts[512] = "";
     const AVDictionaryEntry *e = NULL;
     AVBPrint bp;
@@ -1155,23 +3753,43 @@ static int configure_audio_filters(VideoState *is, const char *afilters, int for
         goto end;
     }
 
-    if ((ret = av_opt_set(filt_asink, "sample_formats", "s16", AV_OPT_SEARCH_CHILDREN)) < 0)
-        goto end;
-
     if (force_output_format) {
+        if ((ret = av_opt_set_array(filt_asink, "sample_formats", AV_OPT_SEARCH_CHILDREN,
+                                    0, 1, AV_OPT_TYPE_SAMPLE_FMT, &is->audio_tgt.fmt)) < 0)
+            goto end;
         if ((ret = av_opt_set_array(filt_asink, "channel_layouts", AV_OPT_SEARCH_CHILDREN,
                                     0, 1, AV_OPT_TYPE_CHLAYOUT, &is->audio_tgt.ch_layout)) < 0)
             goto end;
         if ((ret = av_opt_set_array(filt_asink, "samplerates", AV_OPT_SEARCH_CHILDREN,
                                     0, 1, AV_OPT_TYPE_INT, &is->audio_tgt.freq)) < 0)
             goto end;
+    } else {
+        /* float sources stay float, the device is then opened in that format */
+        static const enum AVSampleFormat sample_fmts[] = { AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16 };
+        if ((ret = av_opt_set_array(filt_asink, "sample_formats", AV_OPT_SEARCH_CHILDREN,
+                                    0, FF_ARRAY_ELEMS(sample_fmts), AV_OPT_TYPE_SAMPLE_FMT, sample_fmts)) < 0)
+            goto end;
     }
 
     ret = avfilter_init_dict(filt_asink, NULL);
     if (ret < 0)
         goto end;
 
-    if ((ret = configure_filtergraph(is->agraph, afilters, filt_asrc, filt_asink)) < 0)
+    /* the tempo is changed with commands while playing, see update_audio_tempo() */
+    is->tempo_out_origin = NAN;
+    is->audio_tempo = is->live_tempo.load(std::memory_order_relaxed) * is->speed.load(std::memory_order_relaxed);
+    if (is->live || is->speed.load(std::memory_order_relaxed) != 1.0) {
+        char tempo_args[32];
+
+        snprintf(tempo_args, sizeof(tempo_args), "tempo=%f", is->audio_tempo);
+        if ((ret = avfilter_graph_create_filter(&filt_atempo, avfilter_get_by_name("atempo"), "ffplay_atempo",
+                                                tempo_args, NULL, is->agraph)) < 0)
+            goto end;
+        if ((ret = avfilter_link(filt_atempo, 0, filt_asink, 0)) < 0)
+            goto end;
+    }
+
+    if ((ret = configure_filtergraph(is->agraph, afilters, filt_asrc, filt_atempo ? filt_atempo : filt_asink)) < 0)
         goto end;
 
     is->in_audio_filter  = filt_asrc;
@@ -1185,41 +3803,67 @@ end:
     return ret;
 }
 
+/* return the number of queued frames, including the last shown one */
+static inline int frame_queue_size(FrameQueue *f)
+{
+    return f->windex.load(std::memory_order_acquire) - f->rindex.load(std::memory_order_acquire);
+}
+
 /* return the number of undisplayed frames in the queue */
 static int frame_queue_nb_remaining(FrameQueue *f)
 {
-    return f->size - f->rindex_shown;
+    return frame_queue_size(f) - f->rindex_shown;
 }
 
-static Frame *frame_queue_peek_readable(FrameQueue *f)
+/* sleep until the queue has room (for_space) or a readable frame, or until abort */
+static void frame_queue_wait(FrameQueue *f, int for_space)
 {
-    /* wait until we have a readable a new frame */
     SDL_LockMutex(f->mutex);
-    while (f->size - f->rindex_shown <= 0 &&
-           !f->pktq->abort_request) {
+    f->nb_waiters.fetch_add(1, std::memory_order_relaxed);
+    /* pairs with the fence in frame_queue_wake() */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!f->pktq->abort_request &&
+           (for_space ? frame_queue_size(f) >= f->max_size : frame_queue_nb_remaining(f) <= 0))
         SDL_CondWait(f->cond, f->mutex);
-    }
+    f->nb_waiters.fetch_sub(1, std::memory_order_relaxed);
     SDL_UnlockMutex(f->mutex);
+}
+
+static void frame_queue_wake(FrameQueue *f)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (f->nb_waiters.load(std::memory_order_relaxed))
+        frame_queue_signal(f);
+}
+
+static Frame *frame_queue_peek_readable(FrameQueue *f)
+{
+    /* wait until we have a readable a new frame */
+    if (frame_queue_nb_remaining(f) <= 0)
+        frame_queue_wait(f, 0);
 
     if (f->pktq->abort_request)
         return NULL;
 
-    return &f->queue[(f->rindex + f->rindex_shown) % f->max_size];
+    return &f->queue[(f->rindex + f->rindex_shown) & (f->capacity - 1)];
 }
 
 static void frame_queue_next(FrameQueue *f)
 {
+    unsigned rindex;
+
     if (f->keep_last && !f->rindex_shown) {
         f->rindex_shown = 1;
-        return;
+    } else {
+        rindex = f->rindex.load(std::memory_order_relaxed);
+        frame_queue_unref_item(&f->queue[rindex & (f->capacity - 1)]);
+        /* hand the slot back to the producer */
+        f->rindex.store(rindex + 1, std::memory_order_release);
+        frame_queue_wake(f);
     }
-    frame_queue_unref_item(&f->queue[f->rindex]);
-    if (++f->rindex == f->max_size)
-        f->rindex = 0;
-    SDL_LockMutex(f->mutex);
-    f->size--;
-    SDL_CondSignal(f->cond);
-    SDL_UnlockMutex(f->mutex);
+    /* at EOF read_thread waits for playback to run dry before looping or exiting */
+    if (frame_queue_nb_remaining(f) <= 0)
+        read_wakeup_signal(f->pktq->continue_read);
 }
 
 /* return the wanted number of samples to get better sync if sync_type is video
@@ -1279,17 +3923,11 @@ static int audio_decode_frame(VideoState *is)
     int wanted_nb_samples;
     Frame *af;
 
-    if (is->paused)
+    /* audio is muted while video plays backwards */
+    if (is->paused || is->reverse)
         return -1;
 
     do {
-#if defined(_WIN32)
-        while (frame_queue_nb_remaining(&is->sampq) == 0) {
-            if ((av_gettime_relative() - audio_callback_time) > 1000000LL * is->audio_hw_buf_size / is->audio_tgt.bytes_per_sec / 2)
-                return -1;
-            av_usleep (1000);
-        }
-#endif
         if (!(af = frame_queue_peek_readable(&is->sampq)))
             return -1;
         frame_queue_next(&is->sampq);
@@ -1365,10 +4003,11 @@ static int audio_decode_frame(VideoState *is)
     audio_clock0 = is->audio_clock;
     /* update the audio clock with the pts */
     if (!isnan(af->pts))
-        is->audio_clock = af->pts + (double) af->frame->nb_samples / af->frame->sample_rate;
+        is->audio_clock = af->pts + af->duration;
     else
         is->audio_clock = NAN;
     is->audio_clock_serial = af->serial;
+    is->audio_clock_tempo = af->duration * af->frame->sample_rate / af->frame->nb_samples;
 #ifdef DEBUG
     {
         static double last_clock;
@@ -1381,18 +4020,26 @@ static int audio_decode_frame(VideoState *is)
     return resampled_data_size;
 }
 
-/* copy samples for viewing in editor window */
-static void update_sample_display(VideoState *is, short *samples, int samples_size)
+/* copy samples for viewing in editor window, as floats in [-1, 1] */
+static void update_sample_display(VideoState *is, const uint8_t *samples, int samples_size)
 {
-    int size, len;
+    int flt = is->audio_tgt.fmt == AV_SAMPLE_FMT_FLT;
+    int size, len, i;
 
-    size = samples_size / sizeof(short);
+    size = samples_size / av_get_bytes_per_sample(is->audio_tgt.fmt);
     while (size > 0) {
         len = SAMPLE_ARRAY_SIZE - is->sample_array_index;
         if (len > size)
             len = size;
-        memcpy(is->sample_array + is->sample_array_index, samples, len * sizeof(short));
-        samples += len;
+        if (flt) {
+            memcpy(is->sample_array + is->sample_array_index, samples, len * sizeof(float));
+            samples += len * sizeof(float);
+        } else {
+            const int16_t *s16 = (const int16_t *)samples;
+            for (i = 0; i < len; i++)
+                is->sample_array[is->sample_array_index + i] = s16[i] * (1.0f / 32768);
+            samples += len * sizeof(int16_t);
+        }
         is->sample_array_index += len;
         if (is->sample_array_index >= SAMPLE_ARRAY_SIZE)
             is->sample_array_index = 0;
@@ -1402,50 +4049,87 @@ static void update_sample_display(VideoState *is, short *samples, int samples_si
 
 
 /* prepare a new audio buffer */
+/* Runs on SDL's audio thread: only copies what audio_render_thread() left in
+ * the PCM ring, it never decodes, allocates or locks. */
 static void sdl_audio_callback(void *opaque, Uint8 *stream, int len)
 {
     VideoState *is = static_cast<VideoState *>(opaque);
-    int audio_size, len1;
+    PcmRing *r = &is->pcm_ring;
+    const uint8_t *buf;
+    const PcmMark *mark;
+    int len1, pending;
 
     audio_callback_time = av_gettime_relative();
 
+    /* audio is muted while video plays backwards */
+    if (is->paused || is->reverse) {
+        memset(stream, 0, len);
+        return;
+    }
+
+    pcm_ring_skip_stale(r, is->audioq.serial);
     while (len > 0) {
-        if (is->audio_buf_index >= is->audio_buf_size) {
-           audio_size = audio_decode_frame(is);
-           if (audio_size < 0) {
-                /* if error, just output silence */
-               is->audio_buf = NULL;
-               is->audio_buf_size = SDL_AUDIO_MIN_BUFFER_SIZE / is->audio_tgt.frame_size * is->audio_tgt.frame_size;
-           } else {
-               if (is->show_mode != VideoState::SHOW_MODE_VIDEO)
-                   update_sample_display(is, (int16_t *)is->audio_buf, audio_size);
-               is->audio_buf_size = audio_size;
-           }
-           is->audio_buf_index = 0;
-        }
-        len1 = is->audio_buf_size - is->audio_buf_index;
-        if (len1 > len)
-            len1 = len;
-        if (!is->muted && is->audio_buf && is->audio_volume == SDL_MIX_MAXVOLUME)
-            memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-        else {
-            memset(stream, 0, len1);
-            if (!is->muted && is->audio_buf)
-                SDL_MixAudioFormat(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, AUDIO_S16SYS, len1, is->audio_volume);
+        if (!(len1 = pcm_ring_peek(r, &buf, len))) {
+            /* nothing is expected before the first frame of a serial nor at the end */
+            if (r->last_mark.serial == is->audioq.serial && is->auddec.finished != is->audioq.serial)
+                is->audio_underruns++;
+            memset(stream, 0, len);
+            break;
         }
+        audio_gain_apply(is, stream, buf, len1);
+        if (is->show_mode != VideoState::SHOW_MODE_VIDEO)
+            update_sample_display(is, buf, len1);
+        pcm_ring_consume(r, len1);
         len -= len1;
         stream += len1;
-        is->audio_buf_index += len1;
     }
-    is->audio_write_buf_size = is->audio_buf_size - is->audio_buf_index;
+    /* the visualization gets the samples as they are handed to SDL */
+    is->audio_write_buf_size = 0;
     /* Let's assume the audio driver that is used by SDL has two periods. */
-    if (!isnan(is->audio_clock)) {
-        set_clock_at(&is->audclk, is->audio_clock - (double)(2 * is->audio_hw_buf_size + is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec, is->audio_clock_serial, audio_callback_time / 1000000.0);
+    mark = pcm_ring_current_mark(r, &pending);
+    if (!isnan(mark->clock)) {
+        /* the clock runs at the tempo of what is being played */
+        is->audclk.speed = mark->tempo;
+        set_clock_at(&is->audclk, mark->clock - (double)(2 * is->audio_hw_buf_size + pending) / is->audio_tgt.bytes_per_sec * mark->tempo,
+                     mark->serial, audio_callback_time / 1000000.0);
         sync_clock_to_slave(&is->extclk, &is->audclk);
     }
 }
 
-static int audio_open(void *opaque, AVChannelLayout *wanted_channel_layout, int wanted_sample_rate, struct AudioParams *audio_hw_params)
+/* Decodes, filters and resamples ahead of the audio callback into the PCM
+ * ring, sleeping a fraction of the device buffer whenever the ring is full. */
+static int audio_render_thread(void *arg)
+{
+    VideoState *is = static_cast<VideoState *>(arg);
+    PcmRing *r = &is->pcm_ring;
+    int64_t wait = FFMAX(1000, 1000000LL * is->audio_hw_buf_size / is->audio_tgt.bytes_per_sec / 4);
+    const uint8_t *buf;
+    int size, len;
+
+    trace_set_thread_name("audio_render");
+    while (!is->audio_render_abort) {
+        if ((size = audio_decode_frame(is)) < 0) {
+            /* paused, reversed or aborting */
+            av_usleep(wait);
+            continue;
+        }
+        buf = is->audio_buf;
+        while (size > 0 && !is->audio_render_abort) {
+            if (!(len = pcm_ring_write(r, buf, size))) {
+                av_usleep(wait);
+                continue;
+            }
+            buf += len;
+            size -= len;
+        }
+        while (pcm_ring_mark(r, is->audio_clock, is->audio_clock_tempo, is->audio_clock_serial) < 0 && !is->audio_render_abort)
+            av_usleep(wait);
+    }
+    return 0;
+}
+
+static int audio_open(void *opaque, AVChannelLayout *wanted_channel_layout, int wanted_sample_rate, enum AVSampleFormat wanted_sample_fmt,
+                      struct AudioParams *audio_hw_params)
 {
     SDL_AudioSpec wanted_spec, spec;
     const char *env;
@@ -1473,12 +4157,19 @@ static int audio_open(void *opaque, AVChannelLayout *wanted_channel_layout, int
     }
     while (next_sample_rate_idx && next_sample_rates[next_sample_rate_idx] >= wanted_spec.freq)
         next_sample_rate_idx--;
-    wanted_spec.format = AUDIO_S16SYS;
+    /* ask for float when the samples already are, so neither swr nor SDL
+       converts them on devices that mix in float */
+    wanted_spec.format = wanted_sample_fmt == AV_SAMPLE_FMT_FLT ? AUDIO_F32SYS : AUDIO_S16SYS;
     wanted_spec.silence = 0;
     wanted_spec.samples = FFMAX(SDL_AUDIO_MIN_BUFFER_SIZE, 2 << av_log2(wanted_spec.freq / SDL_AUDIO_MAX_CALLBACKS_PER_SEC));
     wanted_spec.callback = sdl_audio_callback;
     wanted_spec.userdata = opaque;
-    while (!(audio_dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE))) {
+    if (benchmark) {
+        /* nothing is played, convert to what the device would have been asked for */
+        spec = wanted_spec;
+        spec.size = spec.samples * spec.channels * SDL_AUDIO_BITSIZE(spec.format) / 8;
+    }
+    while (!benchmark && !(audio_dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE))) {
         av_log(NULL, AV_LOG_WARNING, "SDL_OpenAudio (%d channels, %d Hz): %s\n",
                wanted_spec.channels, wanted_spec.freq, SDL_GetError());
         wanted_spec.channels = next_nb_channels[FFMIN(7, wanted_spec.channels)];
@@ -1493,7 +4184,7 @@ static int audio_open(void *opaque, AVChannelLayout *wanted_channel_layout, int
         }
         av_channel_layout_default(wanted_channel_layout, wanted_spec.channels);
     }
-    if (spec.format != AUDIO_S16SYS) {
+    if (spec.format != AUDIO_S16SYS && spec.format != AUDIO_F32SYS) {
         av_log(NULL, AV_LOG_ERROR,
                "SDL advised audio format %d is not supported!\n", spec.format);
         return -1;
@@ -1508,7 +4199,7 @@ static int audio_open(void *opaque, AVChannelLayout *wanted_channel_layout, int
         }
     }
 
-    audio_hw_params->fmt = AV_SAMPLE_FMT_S16;
+    audio_hw_params->fmt = spec.format == AUDIO_F32SYS ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
     audio_hw_params->freq = spec.freq;
     if (av_channel_layout_copy(&audio_hw_params->ch_layout, wanted_channel_layout) < 0)
         return -1;
@@ -1521,22 +4212,102 @@ static int audio_open(void *opaque, AVChannelLayout *wanted_channel_layout, int
     return spec.size;
 }
 
-static int decoder_init(Decoder *d, AVCodecContext *avctx, PacketQueue *queue, SDL_cond *empty_queue_cond) {
-    memset(d, 0, sizeof(Decoder));
+static int decoder_init(Decoder *d, AVCodecContext *avctx, PacketQueue *queue) {
+    /* value-initialize rather than memset, Decoder holds std::atomic members */
+    new (d) Decoder();
     d->pkt = av_packet_alloc();
     if (!d->pkt)
         return AVERROR(ENOMEM);
     d->avctx = avctx;
     d->queue = queue;
-    d->empty_queue_cond = empty_queue_cond;
+    if (avctx->pkt_timebase.num)
+        queue->low_water_duration = av_rescale_q(AV_TIME_BASE / 2, AV_TIME_BASE_Q, avctx->pkt_timebase);
     d->start_pts = AV_NOPTS_VALUE;
     d->pkt_serial = -1;
+    d->seek_serial = -1;
+    d->skip_frame = avctx->skip_frame;
+    d->speed_skip_frame = AVDISCARD_NONE;
+    d->degrade_skip_frame = AVDISCARD_NONE;
+    d->nal_length_size = -1;
+    if (avctx->codec_id == AV_CODEC_ID_H264)
+        d->nal_length_size = avctx->extradata_size >= 7 && avctx->extradata[0] == 1 ?
+                             (avctx->extradata[4] & 3) + 1 : 0;
     return 0;
 }
 
+/* H.264: a picture whose slices all have nal_ref_idc 0 is referenced by
+   nothing, for demuxers that do not set AV_PKT_FLAG_DISPOSABLE themselves */
+static int h264_packet_disposable(const AVPacket *pkt, int nal_length_size)
+{
+    const uint8_t *p = pkt->data, *end = pkt->data + pkt->size;
+    int i, len, type, slices = 0;
+
+    while (p < end) {
+        if (nal_length_size) {
+            uint32_t nal_len = 0;
+
+            if (end - p < nal_length_size)
+                break;
+            for (i = 0; i < nal_length_size; i++)
+                nal_len = (nal_len << 8) | *p++;
+            if (!nal_len || nal_len > (uint32_t)(end - p))
+                break;
+            len = nal_len;
+        } else {
+            while (end - p >= 3 && (p[0] || p[1] || p[2] != 1))
+                p++;
+            if (end - p < 4)
+                break;
+            p += 3;
+            len = 1;
+        }
+        type = p[0] & 0x1f;
+        if (type == 1 || type == 5) {
+            if (p[0] & 0x60)
+                return 0;
+            slices++;
+        }
+        p += len;
+    }
+    return slices > 0;
+}
+
+/* decoder thread: enter or leave catch-up */
+static void decoder_set_catch_up(Decoder *d, int catch_up)
+{
+    int64_t now = av_gettime_relative();
+
+    if (catch_up == d->catch_up)
+        return;
+    d->catch_up = catch_up;
+    if (catch_up) {
+        d->catch_up_start = now;
+        d->catch_ups++;
+    } else {
+        d->catch_up_time += now - d->catch_up_start;
+        av_log(NULL, AV_LOG_VERBOSE, "Video caught up after %.2f s, %" PRId64 " packets skipped so far\n",
+               (now - d->catch_up_start) / 1000000.0, d->catch_up_skipped);
+    }
+}
+
+
+/* accurate seeking: return 1 if something of the current serial spanning
+   [ts, ts + duration) in time base tb ends before the seek target */
+static int decoder_before_seek_target(Decoder *d, int64_t ts, int64_t duration, AVRational tb)
+{
+    int64_t target;
+
+    if (d->pkt_serial != d->seek_serial.load(std::memory_order_acquire) || ts == AV_NOPTS_VALUE)
+        return 0;
+    target = d->seek_target.load(std::memory_order_relaxed);
+    if (duration > 0)
+        return av_compare_ts(ts + duration, tb, target, AV_TIME_BASE_Q) <= 0;
+    return av_compare_ts(ts, tb, target, AV_TIME_BASE_Q) < 0;
+}
 
 static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
     int ret = AVERROR(EAGAIN);
+    int64_t start, trace;
 
     for (;;) {
         if (d->queue->serial == d->pkt_serial) {
@@ -1544,6 +4315,8 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
                 if (d->queue->abort_request)
                     return -1;
 
+                start = av_gettime_relative();
+                trace = trace_begin();
                 switch (d->avctx->codec_type) {
                     case AVMEDIA_TYPE_VIDEO:
                         ret = avcodec_receive_frame(d->avctx, frame);
@@ -1570,27 +4343,38 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
                         }
                         break;
                 }
+                d->decode_time += av_gettime_relative() - start;
+                if (ret != AVERROR(EAGAIN))
+                    trace_end("avcodec_receive_frame", trace);
                 if (ret == AVERROR_EOF) {
                     d->finished = d->pkt_serial;
+                    read_wakeup_signal(d->queue->continue_read);
                     avcodec_flush_buffers(d->avctx);
                     return 0;
                 }
-                if (ret >= 0)
+                if (ret >= 0) {
+                    d->frame_decode_time = d->decode_time / 1000000.0;
+                    d->codec_time += d->decode_time;
+                    d->nb_frames++;
+                    d->decode_time = 0;
                     return 1;
+                }
             } while (ret != AVERROR(EAGAIN));
         }
 
         do {
-            if (d->queue->nb_packets == 0)
-                SDL_CondSignal(d->empty_queue_cond);
             if (d->packet_pending) {
                 d->packet_pending = 0;
             } else {
                 int old_serial = d->pkt_serial;
-                if (packet_queue_get(d->queue, d->pkt, 1, &d->pkt_serial) < 0)
+                int got_packet = packet_queue_get(d->queue, d->pkt, 1, &d->pkt_serial);
+                if (got_packet < 0)
                     return -1;
+                if (!got_packet)
+                    return 0;
                 if (old_serial != d->pkt_serial) {
                     avcodec_flush_buffers(d->avctx);
+                    decoder_set_catch_up(d, 0);
                     d->finished = 0;
                     d->next_pts = d->start_pts;
                     d->next_pts_tb = d->start_pts_tb;
@@ -1603,7 +4387,9 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
 
         if (d->avctx->codec_type == AVMEDIA_TYPE_SUBTITLE) {
             int got_frame = 0;
+            trace = trace_begin();
             ret = avcodec_decode_subtitle2(d->avctx, sub, &got_frame, d->pkt);
+            trace_end("avcodec_decode_subtitle2", trace);
             if (ret < 0) {
                 ret = AVERROR(EAGAIN);
             } else {
@@ -1614,6 +4400,16 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
             }
             av_packet_unref(d->pkt);
         } else {
+            /* catch-up: while far behind, what nothing else depends on is
+               dropped before the codec ever sees it */
+            if (d->catch_up && d->pkt->data &&
+                ((d->pkt->flags & AV_PKT_FLAG_DISPOSABLE) ||
+                 (d->nal_length_size >= 0 && h264_packet_disposable(d->pkt, d->nal_length_size)))) {
+                d->catch_up_skipped++;
+                av_packet_unref(d->pkt);
+                continue;
+            }
+
             if (d->pkt->buf && !d->pkt->opaque_ref) {
                 FrameData *fd;
 
@@ -1624,7 +4420,18 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
                 fd->pkt_pos = d->pkt->pos;
             }
 
-            if (avcodec_send_packet(d->avctx, d->pkt) == AVERROR(EAGAIN)) {
+            /* nothing references non-reference frames, so those before an
+               accurate seek target need not be decoded at all */
+            if (d->avctx->codec_type == AVMEDIA_TYPE_VIDEO)
+                d->avctx->skip_frame = decoder_before_seek_target(d, d->pkt->pts, d->pkt->duration, d->avctx->pkt_timebase) ?
+                                       FFMAX(d->skip_frame, AVDISCARD_NONREF) : FFMAX3(d->skip_frame, d->speed_skip_frame.load(std::memory_order_relaxed), d->degrade_skip_frame);
+
+            start = av_gettime_relative();
+            trace = trace_begin();
+            ret = avcodec_send_packet(d->avctx, d->pkt);
+            trace_end("avcodec_send_packet", trace);
+            d->decode_time += av_gettime_relative() - start;
+            if (ret == AVERROR(EAGAIN)) {
                 av_log(d->avctx, AV_LOG_ERROR, "Receive_frame and send_packet both returned EAGAIN, which is an API violation.\n");
                 d->packet_pending = 1;
             } else {
@@ -1653,32 +4460,44 @@ int cmp_audio_fmts(enum AVSampleFormat fmt1, int64_t channel_count1,
 
 static void frame_queue_push(FrameQueue *f)
 {
-    if (++f->windex == f->max_size)
-        f->windex = 0;
-    SDL_LockMutex(f->mutex);
-    f->size++;
-    SDL_CondSignal(f->cond);
-    SDL_UnlockMutex(f->mutex);
+    /* publish the frame written through frame_queue_peek_writable() */
+    f->windex.store(f->windex.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    f->peak_size = FFMAX(f->peak_size, frame_queue_size(f));
+    frame_queue_wake(f);
 }
 
 static Frame *frame_queue_peek_writable(FrameQueue *f)
 {
     /* wait until we have space to put a new frame */
-    SDL_LockMutex(f->mutex);
-    while (f->size >= f->max_size &&
-           !f->pktq->abort_request) {
-        SDL_CondWait(f->cond, f->mutex);
-    }
-    SDL_UnlockMutex(f->mutex);
+    if (frame_queue_size(f) >= f->max_size)
+        frame_queue_wait(f, 1);
 
     if (f->pktq->abort_request)
         return NULL;
 
-    return &f->queue[f->windex];
+    return &f->queue[f->windex & (f->capacity - 1)];
 }
 
 
 
+/* audio_thread: switch atempo to another tempo, continuing the stream time
+   mapping from the end of the last frame output at the previous one */
+static void update_audio_tempo(VideoState *is, double tempo, double last_out)
+{
+    char arg[32];
+
+    if (tempo == is->audio_tempo || !is->agraph)
+        return;
+    snprintf(arg, sizeof(arg), "%f", tempo);
+    if (avfilter_graph_send_command(is->agraph, "ffplay_atempo", "tempo", arg, NULL, 0, 0) < 0)
+        return;
+    if (!isnan(is->tempo_out_origin) && !isnan(last_out)) {
+        is->tempo_stream_origin += (last_out - is->tempo_out_origin) * is->audio_tempo;
+        is->tempo_out_origin = last_out;
+    }
+    is->audio_tempo = tempo;
+}
+
 static int audio_thread(void *arg)
 {
     VideoState *is = static_cast<VideoState *>(arg);
@@ -1689,14 +4508,24 @@ static int audio_thread(void *arg)
     int got_frame = 0;
     AVRational tb;
     int ret = 0;
+    int64_t trace;
+    double out_pts, last_out = NAN;
 
     if (!frame)
         return AVERROR(ENOMEM);
+    trace_set_thread_name("audio_decoder");
 
     do {
         if ((got_frame = decoder_decode_frame(&is->auddec, frame, NULL)) < 0)
             goto the_end;
 
+        /* accurate seeking: drop what precedes the target before filtering */
+        if (got_frame && decoder_before_seek_target(&is->auddec, frame->pts, frame->nb_samples,
+                                                    (AVRational){1, frame->sample_rate})) {
+            av_frame_unref(frame);
+            continue;
+        }
+
         if (got_frame) {
                 tb = (AVRational){1, frame->sample_rate};
 
@@ -1705,7 +4534,9 @@ static int audio_thread(void *arg)
                                    static_cast<AVSampleFormat>(frame->format), frame->ch_layout.nb_channels)    ||
                     av_channel_layout_compare(&is->audio_filter_src.ch_layout, &frame->ch_layout) ||
                     is->audio_filter_src.freq           != frame->sample_rate ||
-                    is->auddec.pkt_serial               != last_serial;
+                    is->auddec.pkt_serial               != last_serial        ||
+                    /* atempo only sits in the graph when something needs it */
+                    (is->agraph && avfilter_graph_get_filter(is->agraph, "ffplay_atempo")) != (is->live || is->speed.load(std::memory_order_relaxed) != 1.0);
 
                 if (reconfigure) {
                     char buf1[1024], buf2[1024];
@@ -1724,21 +4555,36 @@ static int audio_thread(void *arg)
 
                     if ((ret = configure_audio_filters(is, afilters, 1)) < 0)
                         goto the_end;
+                    last_out = NAN;
                 }
 
-            if ((ret = av_buffersrc_add_frame(is->in_audio_filter, frame)) < 0)
+            update_audio_tempo(is, is->live_tempo.load(std::memory_order_relaxed) * is->speed.load(std::memory_order_relaxed), last_out);
+
+            trace = trace_begin();
+            ret = av_buffersrc_add_frame(is->in_audio_filter, frame);
+            trace_end("av_buffersrc_add_frame", trace);
+            if (ret < 0)
                 goto the_end;
 
-            while ((ret = av_buffersink_get_frame_flags(is->out_audio_filter, frame, 0)) >= 0) {
+            for (;;) {
+                trace = trace_begin();
+                if ((ret = av_buffersink_get_frame_flags(is->out_audio_filter, frame, 0)) < 0)
+                    break;
+                trace_end("av_buffersink_get_frame_flags", trace);
                 FrameData *fd = frame->opaque_ref ? (FrameData*)frame->opaque_ref->data : NULL;
                 tb = av_buffersink_get_time_base(is->out_audio_filter);
                 if (!(af = frame_queue_peek_writable(&is->sampq)))
                     goto the_end;
 
-                af->pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
+                /* atempo counts output time, pts and duration are wanted in stream time */
+                out_pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
+                if (isnan(is->tempo_out_origin) && !isnan(out_pts))
+                    is->tempo_out_origin = is->tempo_stream_origin = out_pts;
+                af->pts = is->tempo_stream_origin + (out_pts - is->tempo_out_origin) * is->audio_tempo;
                 af->pos = fd ? fd->pkt_pos : -1;
                 af->serial = is->auddec.pkt_serial;
-                af->duration = av_q2d((AVRational){frame->nb_samples, frame->sample_rate});
+                af->duration = av_q2d((AVRational){frame->nb_samples, frame->sample_rate}) * is->audio_tempo;
+                last_out = out_pts + av_q2d((AVRational){frame->nb_samples, frame->sample_rate});
 
                 av_frame_move_ref(af->frame, frame);
                 frame_queue_push(&is->sampq);
@@ -1746,13 +4592,16 @@ static int audio_thread(void *arg)
                 if (is->audioq.serial != is->auddec.pkt_serial)
                     break;
             }
-            if (ret == AVERROR_EOF)
+            if (ret == AVERROR_EOF) {
                 is->auddec.finished = is->auddec.pkt_serial;
+                read_wakeup_signal(&is->continue_read_thread);
+            }
         }
     } while (ret >= 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF);
  the_end:
     avfilter_graph_free(&is->agraph);
     av_frame_free(&frame);
+    bench_stage_done(is, BENCH_STAGE_AUDIO);
     return ret;
 }
 
@@ -1775,6 +4624,12 @@ static int get_video_frame(VideoState *is, AVFrame *frame)
     if ((got_picture = decoder_decode_frame(&is->viddec, frame, NULL)) < 0)
         return -1;
 
+    /* accurate seeking: drop what precedes the target before filtering */
+    if (got_picture && decoder_before_seek_target(&is->viddec, frame->pts, frame->duration, is->video_st->time_base)) {
+        av_frame_unref(frame);
+        return 0;
+    }
+
     if (got_picture) {
         double dpts = NAN;
 
@@ -1786,6 +4641,9 @@ static int get_video_frame(VideoState *is, AVFrame *frame)
         if (framedrop>0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER)) {
             if (frame->pts != AV_NOPTS_VALUE) {
                 double diff = dpts - get_master_clock(is);
+                if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD && !is->step &&
+                    is->viddec.pkt_serial == is->vidclk.serial)
+                    decoder_set_catch_up(&is->viddec, -diff > (is->viddec.catch_up ? CATCHUP_EXIT_LAG : CATCHUP_ENTER_LAG));
                 if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD &&
                     diff - is->frame_last_filter_delay < 0 &&
                     is->viddec.pkt_serial == is->vidclk.serial &&
@@ -1821,12 +4679,24 @@ static int configure_video_filters(AVFilterGraph *graph, VideoState *is, const c
 
     for (i = 0; i < renderer_info.num_texture_formats; i++) {
         for (j = 0; j < FF_ARRAY_ELEMS(sdl_texture_format_map); j++) {
-            if (renderer_info.texture_formats[i] == sdl_texture_format_map[j].texture_fmt) {
+            if ((int)renderer_info.texture_formats[i] == sdl_texture_format_map[j].texture_fmt) {
                 pix_fmts[nb_pix_fmts++] = sdl_texture_format_map[j].format;
                 break;
             }
         }
     }
+    /* P010 shares the NV12 texture. Offer it only for frames that already are
+       P010 (e.g. downloaded from a hwaccel); anything else, yuv420p10le
+       included, is better converted by swscale straight to NV12 than to P010
+       and then narrowed again by upload_texture_p010() */
+    if (frame->format == AV_PIX_FMT_P010) {
+        for (i = 0; i < nb_pix_fmts; i++) {
+            if (pix_fmts[i] == AV_PIX_FMT_NV12) {
+                pix_fmts[nb_pix_fmts++] = AV_PIX_FMT_P010;
+                break;
+            }
+        }
+    }
 
     while ((e = av_dict_iterate(sws_dict, e))) {
         if (!strcmp(e->key, "sws_flags")) {
@@ -1995,6 +4865,7 @@ static void set_default_window_size(int width, int height, AVRational sar)
 static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, double duration, int64_t pos, int serial)
 {
     Frame *vp;
+    int64_t trace = trace_begin();
 
 #if defined(DEBUG_SYNC)
     printf("frame_type=%c pts=%0.3f\n",
@@ -2006,6 +4877,7 @@ static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, double
 
     vp->sar = src_frame->sample_aspect_ratio;
     vp->uploaded = 0;
+    vp->texture = -1;
 
     vp->width = src_frame->width;
     vp->height = src_frame->height;
@@ -2020,10 +4892,31 @@ static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, double
 
     av_frame_move_ref(vp->frame, src_frame);
     frame_queue_push(&is->pictq);
+    trace_end("queue_picture", trace);
+
+    /* pairs with the fence in refresh_wait_event() */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (is->refresh_wanted.load(std::memory_order_relaxed) && is->refresh_wanted.exchange(0)) {
+        SDL_Event event;
+
+        event.type = FF_REFRESH_EVENT;
+        event.user.data1 = is;
+        SDL_PushEvent(&event);
+    }
     return 0;
 }
 
 
+/* reverse playback: fetch the frame preceding the last one queued from the GOP cache */
+static int get_reverse_frame(VideoState *is, AVFrame *frame)
+{
+    AVRational tb = is->video_st->time_base;
+    int ret = gop_cache_get_prev(is->gop_cache, llrint(is->reverse_pts / av_q2d(tb)), frame, &is->reverse);
+
+    if (ret > 0)
+        is->reverse_pts = frame->pts * av_q2d(tb);
+    return ret;
+}
 
 static int video_thread(void *arg)
 {
@@ -2042,12 +4935,32 @@ static int video_thread(void *arg)
     enum AVPixelFormat last_format = static_cast<enum AVPixelFormat>(-2);
     int last_serial = -1;
     int last_vfilter_idx = 0;
+    int serial;
+    int reverse_serial = -1;
+    int64_t trace;
 
     if (!frame)
         return AVERROR(ENOMEM);
+    trace_set_thread_name("video_decoder");
 
     for (;;) {
-        ret = get_video_frame(is, frame);
+        if (is->reverse) {
+            /* the pictures queued in reverse replace whatever was demuxed,
+               a seek flushes videoq and moves them to its target */
+            serial = is->videoq.serial;
+            if (serial != reverse_serial) {
+                double pos = is->reverse_seek_pts;
+                if (reverse_serial >= 0 && !isnan(pos))
+                    is->reverse_pts = pos;
+                reverse_serial = serial;
+            }
+            ret = get_reverse_frame(is, frame);
+        } else {
+            reverse_serial = -1;
+            ret = get_video_frame(is, frame);
+            serial = is->viddec.pkt_serial;
+            degrade_update(is);
+        }
         if (ret < 0)
             goto the_end;
         if (!ret)
@@ -2056,14 +4969,14 @@ static int video_thread(void *arg)
         if (   last_w != frame->width
             || last_h != frame->height
             || last_format != frame->format
-            || last_serial != is->viddec.pkt_serial
+            || last_serial != serial
             || last_vfilter_idx != is->vfilter_idx) {
             av_log(NULL, AV_LOG_DEBUG,
                    "Video frame changed from size:%dx%d format:%s serial:%d to size:%dx%d format:%s serial:%d\n",
                    last_w, last_h,
                    (const char *)av_x_if_null(av_get_pix_fmt_name(last_format), "none"), last_serial,
                    frame->width, frame->height,
-                   (const char *)av_x_if_null(av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)), "none"), is->viddec.pkt_serial);
+                   (const char *)av_x_if_null(av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)), "none"), serial);
             avfilter_graph_free(&graph);
             graph = avfilter_graph_alloc();
             if (!graph) {
@@ -2083,12 +4996,14 @@ static int video_thread(void *arg)
             last_w = frame->width;
             last_h = frame->height;
             last_format = static_cast<enum AVPixelFormat>(frame->format);
-            last_serial = is->viddec.pkt_serial;
+            last_serial = serial;
             last_vfilter_idx = is->vfilter_idx;
             frame_rate = av_buffersink_get_frame_rate(filt_out);
         }
 
+        trace = trace_begin();
         ret = av_buffersrc_add_frame(filt_in, frame);
+        trace_end("av_buffersrc_add_frame", trace);
         if (ret < 0)
             goto the_end;
 
@@ -2097,13 +5012,17 @@ static int video_thread(void *arg)
 
             is->frame_last_returned_time = av_gettime_relative() / 1000000.0;
 
+            trace = trace_begin();
             ret = av_buffersink_get_frame_flags(filt_out, frame, 0);
             if (ret < 0) {
-                if (ret == AVERROR_EOF)
+                if (ret == AVERROR_EOF && !is->reverse) {
                     is->viddec.finished = is->viddec.pkt_serial;
+                    read_wakeup_signal(&is->continue_read_thread);
+                }
                 ret = 0;
                 break;
             }
+            trace_end("av_buffersink_get_frame_flags", trace);
 
             fd = frame->opaque_ref ? (FrameData*)frame->opaque_ref->data : NULL;
 
@@ -2113,9 +5032,9 @@ static int video_thread(void *arg)
             tb = av_buffersink_get_time_base(filt_out);
             duration = (frame_rate.num && frame_rate.den ? av_q2d((AVRational){frame_rate.den, frame_rate.num}) : 0);
             pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
-            ret = queue_picture(is, frame, pts, duration, fd ? fd->pkt_pos : -1, is->viddec.pkt_serial);
+            ret = queue_picture(is, frame, pts, duration, fd ? fd->pkt_pos : -1, serial);
             av_frame_unref(frame);
-            if (is->videoq.serial != is->viddec.pkt_serial)
+            if (is->videoq.serial != serial)
                 break;
         }
 
@@ -2125,6 +5044,7 @@ static int video_thread(void *arg)
  the_end:
     avfilter_graph_free(&graph);
     av_frame_free(&frame);
+    bench_stage_done(is, BENCH_STAGE_VIDEO);
     return 0;
 }
 
@@ -2135,6 +5055,7 @@ static int subtitle_thread(void *arg)
     int got_subtitle;
     double pts;
 
+    trace_set_thread_name("subtitle_decoder");
     for (;;) {
         if (!(sp = frame_queue_peek_writable(&is->subpq)))
             return 0;
@@ -2163,10 +5084,29 @@ static int subtitle_thread(void *arg)
 }
 
 
+static int frame_queue_alloc_slots(FrameQueue *f, int max_size)
+{
+    int i, capacity;
+
+    f->max_size = av_clip(max_size, 1 + f->keep_last, FRAME_QUEUE_MAX_SIZE);
+    capacity = 1 << av_ceil_log2(f->max_size);
+    if (!(f->queue = static_cast<Frame*>(av_calloc(capacity, sizeof(*f->queue)))))
+        return AVERROR(ENOMEM);
+    f->capacity = capacity;
+    f->rindex = 0;
+    f->windex = 0;
+    f->rindex_shown = 0;
+    for (i = 0; i < f->capacity; i++)
+        if (!(f->queue[i].frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+    return 0;
+}
+
 static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size, int keep_last)
 {
-    int i;
-    memset(f, 0, sizeof(FrameQueue));
+    f->queue = NULL;
+    f->capacity = 0;
+    f->nb_waiters = 0;
     if (!(f->mutex = SDL_CreateMutex())) {
         av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
         return AVERROR(ENOMEM);
@@ -2176,12 +5116,30 @@ static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size, int
         return AVERROR(ENOMEM);
     }
     f->pktq = pktq;
-    f->max_size = FFMIN(max_size, FRAME_QUEUE_SIZE);
-    f->keep_last = !!keep_last;
-    for (i = 0; i < f->max_size; i++)
-        if (!(f->queue[i].frame = av_frame_alloc()))
-            return AVERROR(ENOMEM);
-    return 0;
+    f->keep_last = !!keep_last;
+    return frame_queue_alloc_slots(f, max_size);
+}
+
+/* Change the depth of a queue nobody is using, any queued frame is dropped.
+ * Only valid before the decoder thread and the consumer are (re)started. */
+static int frame_queue_resize(FrameQueue *f, int max_size)
+{
+    if (av_clip(max_size, 1 + f->keep_last, FRAME_QUEUE_MAX_SIZE) == f->max_size)
+        return 0;
+    frame_queue_free_slots(f);
+    return frame_queue_alloc_slots(f, max_size);
+}
+
+/* return the queue depth needed to buffer frame_queue_ms worth of frames
+ * produced at frame_rate, but at least min_size */
+static int frame_queue_depth_for_duration(AVRational frame_rate, int min_size)
+{
+    int64_t nb_frames;
+
+    if (frame_queue_ms <= 0 || frame_rate.num <= 0 || frame_rate.den <= 0)
+        return min_size;
+    nb_frames = av_rescale_rnd(frame_queue_ms, frame_rate.num, 1000LL * frame_rate.den, AV_ROUND_UP);
+    return FFMAX(min_size, (int)FFMIN(nb_frames, FRAME_QUEUE_MAX_SIZE));
 }
 
 
@@ -2194,6 +5152,7 @@ static int stream_component_open(VideoState *is, int stream_index)
     const char *forced_codec_name = NULL;
     AVDictionary *opts = NULL;
     int sample_rate;
+    enum AVSampleFormat sample_fmt;
     AVChannelLayout ch_layout = { static_cast<AVChannelOrder>(0) };
     int ret = 0;
     int stream_lowres = lowres;
@@ -2255,6 +5214,12 @@ static int stream_component_open(VideoState *is, int stream_index)
         ret = create_hwaccel(&avctx->hw_device_ctx);
         if (ret < 0)
             goto fail;
+        if (frame_pool && (codec->capabilities & AV_CODEC_CAP_DR1)) {
+            if ((ret = frame_pool_open(&is->frame_pool)) < 0)
+                goto fail;
+            avctx->opaque      = is->frame_pool;
+            avctx->get_buffer2 = frame_pool_get_buffer2;
+        }
     }
 
     if ((ret = avcodec_open2(avctx, codec, &opts)) < 0) {
@@ -2280,18 +5245,17 @@ static int stream_component_open(VideoState *is, int stream_index)
                 goto fail;
             sink = is->out_audio_filter;
             sample_rate    = av_buffersink_get_sample_rate(sink);
+            sample_fmt     = static_cast<AVSampleFormat>(av_buffersink_get_format(sink));
             ret = av_buffersink_get_ch_layout(sink, &ch_layout);
             if (ret < 0)
                 goto fail;
         }
 
         /* prepare audio output */
-        if ((ret = audio_open(is, &ch_layout, sample_rate, &is->audio_tgt)) < 0)
+        if ((ret = audio_open(is, &ch_layout, sample_rate, sample_fmt, &is->audio_tgt)) < 0)
             goto fail;
         is->audio_hw_buf_size = ret;
         is->audio_src = is->audio_tgt;
-        is->audio_buf_size  = 0;
-        is->audio_buf_index = 0;
 
         /* init averaging filter */
         is->audio_diff_avg_coef  = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
@@ -2300,10 +5264,16 @@ static int stream_component_open(VideoState *is, int stream_index)
            we correct audio sync only if larger than this threshold */
         is->audio_diff_threshold = (double)(is->audio_hw_buf_size) / is->audio_tgt.bytes_per_sec;
 
+        /* the audio callback is not running yet, so sampq can be resized */
+        if ((ret = frame_queue_resize(&is->sampq,
+                                      frame_queue_depth_for_duration(av_make_q(avctx->sample_rate, avctx->frame_size > 0 ? avctx->frame_size : 1024),
+                                                                     sample_queue_size))) < 0)
+            goto fail;
+
         is->audio_stream = stream_index;
         is->audio_st = ic->streams[stream_index];
 
-        if ((ret = decoder_init(&is->auddec, avctx, &is->audioq, is->continue_read_thread)) < 0)
+        if ((ret = decoder_init(&is->auddec, avctx, &is->audioq)) < 0)
             goto fail;
         if (is->ic->iformat->flags & AVFMT_NOTIMESTAMPS) {
             is->auddec.start_pts = is->audio_st->start_time;
@@ -2311,14 +5281,36 @@ static int stream_component_open(VideoState *is, int stream_index)
         }
         if ((ret = decoder_start(&is->auddec, audio_thread, "audio_decoder", is)) < 0)
             goto out;
+        /* -benchmark drains sampq itself, there is no device to feed */
+        if (!benchmark) {
+            /* a few device buffers, at least 50ms */
+            if ((ret = pcm_ring_init(&is->pcm_ring, FFMAX(4 * is->audio_hw_buf_size, is->audio_tgt.bytes_per_sec / 20))) < 0)
+                goto out;
+            is->audio_render_abort = 0;
+            is->audio_underruns = 0;
+            is->audio_render_tid = SDL_CreateThread(audio_render_thread, "audio_render", is);
+            if (!is->audio_render_tid) {
+                av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+                ret = AVERROR(ENOMEM);
+                goto out;
+            }
+        }
         SDL_PauseAudioDevice(audio_dev, 0);
         break;
     case AVMEDIA_TYPE_VIDEO:
+        /* video_refresh does not touch pictq until video_st is set */
+        if ((ret = frame_queue_resize(&is->pictq,
+                                      frame_queue_depth_for_duration(av_guess_frame_rate(ic, ic->streams[stream_index], NULL),
+                                                                     video_picture_queue_size))) < 0)
+            goto fail;
+
         is->video_stream = stream_index;
         is->video_st = ic->streams[stream_index];
 
-        if ((ret = decoder_init(&is->viddec, avctx, &is->videoq, is->continue_read_thread)) < 0)
+        if ((ret = decoder_init(&is->viddec, avctx, &is->videoq)) < 0)
             goto fail;
+        is->viddec.speed_skip_frame = speed_skip_frame(is->speed.load(std::memory_order_relaxed));
+        degrade_init(&is->degrade, avctx);
         if ((ret = decoder_start(&is->viddec, video_thread, "video_decoder", is)) < 0)
             goto out;
         is->queue_attachments_req = 1;
@@ -2327,7 +5319,7 @@ static int stream_component_open(VideoState *is, int stream_index)
         is->subtitle_stream = stream_index;
         is->subtitle_st = ic->streams[stream_index];
 
-        if ((ret = decoder_init(&is->subdec, avctx, &is->subtitleq, is->continue_read_thread)) < 0)
+        if ((ret = decoder_init(&is->subdec, avctx, &is->subtitleq)) < 0)
             goto fail;
         if ((ret = decoder_start(&is->subdec, subtitle_thread, "subtitle_decoder", is)) < 0)
             goto out;
@@ -2385,6 +5377,109 @@ static int stream_has_enough_packets(AVStream *st, int stream_id, PacketQueue *q
            queue->nb_packets > MIN_FRAMES && (!queue->duration || av_q2d(st->time_base) * queue->duration > 1.0);
 }
 
+/* if the queue are full, no need to read more. A full packet ring is never
+   written to from read_thread, so a pending seek is not stuck behind a
+   blocking put. Nothing is demuxed in reverse playback, the seek that enters
+   it flushes the queues and the one leaving it wakes us. */
+static int read_thread_queues_full(VideoState *is)
+{
+    return is->reverse ||
+           packet_queue_full(&is->audioq) || packet_queue_full(&is->videoq) || packet_queue_full(&is->subtitleq) ||
+           (infinite_buffer<1 &&
+             (is->audioq.size + is->videoq.size + is->subtitleq.size > MAX_QUEUE_SIZE
+           || (stream_has_enough_packets(is->audio_st, is->audio_stream, &is->audioq) &&
+               stream_has_enough_packets(is->video_st, is->video_stream, &is->videoq) &&
+               stream_has_enough_packets(is->subtitle_st, is->subtitle_stream, &is->subtitleq))));
+}
+
+/* all decoders hit EOF and every decoded frame has been played */
+static int read_thread_playback_done(VideoState *is)
+{
+    return !is->paused &&
+           (!is->audio_st || (is->auddec.finished == is->audioq.serial && frame_queue_nb_remaining(&is->sampq) == 0)) &&
+           (!is->video_st || (is->viddec.finished == is->videoq.serial && frame_queue_nb_remaining(&is->pictq) == 0));
+}
+
+/* after EOF there is nothing to read, unless playback is done and has to loop or exit */
+static int read_thread_eof_idle(VideoState *is)
+{
+    return !((loop != 1 || autoexit) && read_thread_playback_done(is));
+}
+
+/* sleep as long as idle() holds and no seek, pause toggle, attachment or abort
+   is requested, or for at most timeout_ms if not 0. Once the queues are full,
+   the decoders only wake us when one of them or all of them together drain to
+   low water, which gives demuxing some hysteresis instead of reading a packet
+   every time one is consumed. */
+static void read_thread_wait(VideoState *is, int (*idle)(VideoState *is), int timeout_ms)
+{
+    ReadWakeup *w = &is->continue_read_thread;
+
+    SDL_LockMutex(w->mutex);
+    w->sleeping.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!is->abort_request && !is->seek_req && !is->queue_attachments_req &&
+           is->paused == is->last_paused && idle(is)) {
+        if (timeout_ms) {
+            if (SDL_CondWaitTimeout(w->cond, w->mutex, timeout_ms) == SDL_MUTEX_TIMEDOUT)
+                break;
+        } else {
+            SDL_CondWait(w->cond, w->mutex);
+        }
+    }
+    w->sleeping.store(0, std::memory_order_relaxed);
+    SDL_UnlockMutex(w->mutex);
+}
+
+
+/* -benchmark: consume the pictures as soon as they are queued */
+static int benchmark_video_sink(void *arg)
+{
+    VideoState *is = static_cast<VideoState *>(arg);
+    Frame *vp;
+
+    trace_set_thread_name("video_sink");
+    while ((vp = frame_queue_peek_readable(&is->pictq))) {
+        if (vp->serial == is->videoq.serial)
+            is->bench_video_frames++;
+        frame_queue_next(&is->pictq);
+    }
+    bench_stage_done(is, BENCH_STAGE_VIDEO_SINK);
+    return 0;
+}
+
+/* -benchmark: convert the samples to the output format as the audio callback
+   would, without pacing */
+static int benchmark_audio_sink(void *arg)
+{
+    VideoState *is = static_cast<VideoState *>(arg);
+    int size;
+
+    trace_set_thread_name("audio_sink");
+    /* only call into the conversion once audio is open and a frame is ready */
+    while (frame_queue_peek_readable(&is->sampq)) {
+        audio_callback_time = av_gettime_relative();
+        size = audio_decode_frame(is);
+        if (size > 0)
+            is->bench_audio_samples += size / is->audio_tgt.frame_size;
+    }
+    bench_stage_done(is, BENCH_STAGE_AUDIO_SINK);
+    return 0;
+}
+
+/* -benchmark: start the sinks once the components are open, before that the
+   packet queues are still aborted and the sinks would take that for the end */
+static int benchmark_start_sinks(VideoState *is)
+{
+    is->video_sink_tid = SDL_CreateThread(benchmark_video_sink, "video_sink", is);
+    is->audio_sink_tid = SDL_CreateThread(benchmark_audio_sink, "audio_sink", is);
+    if (!is->video_sink_tid || !is->audio_sink_tid) {
+        av_log(NULL, AV_LOG_FATAL, "SDL_CreateThread(): %s\n", SDL_GetError());
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
 
 static int read_thread(void *arg)
 {
@@ -2396,16 +5491,12 @@ static int read_thread(void *arg)
     int64_t stream_start_time;
     int pkt_in_play_range = 0;
     const AVDictionaryEntry *t;
-    SDL_mutex *wait_mutex = SDL_CreateMutex();
     int scan_all_pmts_set = 0;
     int64_t pkt_ts;
+    int64_t trace;
+    AVDictionary *open_opts = NULL;
 
-    if (!wait_mutex) {
-        av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
-        ret = AVERROR(ENOMEM);
-        goto fail;
-    }
-
+    trace_set_thread_name("read_thread");
     memset(st_index, -1, sizeof(st_index));
     is->eof = 0;
 
@@ -2427,6 +5518,30 @@ static int read_thread(void *arg)
         av_dict_set(&format_opts, "scan_all_pmts", "1", AV_DICT_DONT_OVERWRITE);
         scan_all_pmts_set = 1;
     }
+    /* opening consumes the options it recognizes, keep them for the keyframe scan */
+    if (use_kf_index && av_dict_copy(&open_opts, format_opts, 0) < 0) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if (use_mmap && !(is->iformat && is->iformat->flags & AVFMT_NOFILE)) {
+        err = mapped_input_open(&is->mapped_input, is->filename);
+        if (err >= 0)
+            ic->pb = is->mapped_input->pb;
+        else if (err != AVERROR(ENOSYS))
+            av_log(NULL, AV_LOG_VERBOSE, "%s: could not be mapped, reading it normally\n", is->filename);
+    }
+    if (!ic->pb && readahead_size > 0 && !(is->iformat && is->iformat->flags & AVFMT_NOFILE)) {
+        err = readahead_open(&is->readahead, is->filename, readahead_size * 1024, readahead_window * 1024,
+                             &ic->interrupt_callback, &format_opts);
+        if (err < 0) {
+            char errbuf[AV_ERROR_MAX_STRING_SIZE];
+            av_strerror(err, errbuf, sizeof(errbuf));
+            av_log(NULL, AV_LOG_WARNING, "%s: read-ahead disabled, could not open: %s\n",
+                   is->filename, errbuf);
+        } else {
+            ic->pb = is->readahead->pb;
+        }
+    }
     err = avformat_open_input(&ic, is->filename, is->iformat, &format_opts);
     if (err < 0) {
         print_error(is->filename, err);
@@ -2500,6 +5615,7 @@ static int read_thread(void *arg)
     }
 
     is->realtime = is_realtime(ic);
+    is->live = live_latency > 0 && is->realtime;
 
     if (show_status)
         av_dump_format(ic, 0, is->filename, 0);
@@ -2570,9 +5686,30 @@ static int read_thread(void *arg)
         goto fail;
     }
 
+    if (benchmark && (ret = benchmark_start_sinks(is)) < 0)
+        goto fail;
+
     if (infinite_buffer < 0 && is->realtime)
         infinite_buffer = 1;
 
+    if (is->live) {
+        is->live_stream = is->audio_stream >= 0 ? is->audio_stream : is->video_stream;
+        av_log(NULL, AV_LOG_INFO, "Low-latency live mode, %d ms target%s\n", live_latency,
+               is->audio_stream >= 0 ? "" : ", without audio to time-stretch latency is only measured");
+    } else if (live_latency > 0) {
+        av_log(NULL, AV_LOG_WARNING, "-live_latency ignored, %s is not a realtime input\n", is->filename);
+    }
+    if (playback_speed != 1.0 && is->live)
+        av_log(NULL, AV_LOG_WARNING, "-speed ignored in low-latency live mode\n");
+    set_playback_speed(is, playback_speed);
+
+    /* only formats with poor or no index of their own need ours */
+    if (use_kf_index && is->video_stream >= 0 &&
+        !(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC) &&
+        !(ic->iformat->flags & AVFMT_NO_BYTE_SEEK) &&
+        (ic->iformat->flags & (AVFMT_TS_DISCONT | AVFMT_GENERIC_INDEX)))
+        keyframe_index_open(&is->kf_index, is->filename, ic->iformat, open_opts, is->video_stream);
+
     for (;;) {
         if (is->abort_request)
             break;
@@ -2600,7 +5737,15 @@ static int read_thread(void *arg)
 // FIXME the +-2 is due to rounding being not done in the correct direction in generation
 //      of the seek_pos/seek_rel variables
 
-            ret = avformat_seek_file(is->ic, -1, seek_min, seek_target, seek_max, is->seek_flags);
+            const KeyframeIndexEntry *kf = NULL;
+
+            /* with a keyframe index, jump right to the keyframe's byte offset */
+            if (!(is->seek_flags & AVSEEK_FLAG_BYTE))
+                kf = keyframe_index_lookup(is->kf_index, seek_min, seek_target, seek_max);
+            if (kf)
+                ret = avformat_seek_file(is->ic, -1, kf->pos, kf->pos, kf->pos, AVSEEK_FLAG_BYTE);
+            else
+                ret = avformat_seek_file(is->ic, -1, seek_min, seek_target, seek_max, is->seek_flags);
             if (ret < 0) {
                 av_log(NULL, AV_LOG_ERROR,
                        "%s: error while seeking\n", is->ic->url);
@@ -2611,7 +5756,18 @@ static int read_thread(void *arg)
                     packet_queue_flush(&is->subtitleq);
                 if (is->video_stream >= 0)
                     packet_queue_flush(&is->videoq);
-                if (is->seek_flags & AVSEEK_FLAG_BYTE) {
+                /* the decoders only resume output at the requested position */
+                if (accurate_seek && !(is->seek_flags & AVSEEK_FLAG_BYTE)) {
+                    /* the decoders read these unlocked: the target is
+                       stored before the serial that makes it apply */
+                    is->auddec.seek_target.store(seek_target, std::memory_order_relaxed);
+                    is->viddec.seek_target.store(seek_target, std::memory_order_relaxed);
+                    is->auddec.seek_serial.store(is->audioq.serial, std::memory_order_release);
+                    is->viddec.seek_serial.store(is->videoq.serial, std::memory_order_release);
+                }
+                if (kf && !accurate_seek) {
+                   set_clock(&is->extclk, kf->ts / (double)AV_TIME_BASE, 0);
+                } else if (is->seek_flags & AVSEEK_FLAG_BYTE) {
                    set_clock(&is->extclk, NAN, 0);
                 } else {
                    set_clock(&is->extclk, seek_target / (double)AV_TIME_BASE, 0);
@@ -2633,21 +5789,11 @@ static int read_thread(void *arg)
             is->queue_attachments_req = 0;
         }
 
-        /* if the queue are full, no need to read more */
-        if (infinite_buffer<1 &&
-              (is->audioq.size + is->videoq.size + is->subtitleq.size > MAX_QUEUE_SIZE
-            || (stream_has_enough_packets(is->audio_st, is->audio_stream, &is->audioq) &&
-                stream_has_enough_packets(is->video_st, is->video_stream, &is->videoq) &&
-                stream_has_enough_packets(is->subtitle_st, is->subtitle_stream, &is->subtitleq)))) {
-            /* wait 10 ms */
-            SDL_LockMutex(wait_mutex);
-            SDL_CondWaitTimeout(is->continue_read_thread, wait_mutex, 10);
-            SDL_UnlockMutex(wait_mutex);
+        if (read_thread_queues_full(is)) {
+            read_thread_wait(is, read_thread_queues_full, 0);
             continue;
         }
-        if (!is->paused &&
-            (!is->audio_st || (is->auddec.finished == is->audioq.serial && frame_queue_nb_remaining(&is->sampq) == 0)) &&
-            (!is->video_st || (is->viddec.finished == is->videoq.serial && frame_queue_nb_remaining(&is->pictq) == 0))) {
+        if (read_thread_playback_done(is)) {
             if (loop != 1 && (!loop || --loop)) {
                 stream_seek(is, start_time != AV_NOPTS_VALUE ? start_time : 0, 0, 0);
             } else if (autoexit) {
@@ -2655,7 +5801,9 @@ static int read_thread(void *arg)
                 goto fail;
             }
         }
+        trace = trace_begin();
         ret = av_read_frame(ic, pkt);
+        trace_end("av_read_frame", trace);
         if (ret < 0) {
             if ((ret == AVERROR_EOF || avio_feof(ic->pb)) && !is->eof) {
                 if (is->video_stream >= 0)
@@ -2672,13 +5820,14 @@ static int read_thread(void *arg)
                 else
                     break;
             }
-            SDL_LockMutex(wait_mutex);
-            SDL_CondWaitTimeout(is->continue_read_thread, wait_mutex, 10);
-            SDL_UnlockMutex(wait_mutex);
+            /* only EOF is worth sleeping on until something changes; EAGAIN
+               and transient errors are retried shortly */
+            read_thread_wait(is, read_thread_eof_idle, is->eof ? 0 : 10);
             continue;
         } else {
             is->eof = 0;
         }
+        live_packet_arrived(is, pkt);
         /* check if packet is in play range specified by user, then queue, otherwise discard */
         stream_start_time = ic->streams[pkt->stream_index]->start_time;
         pkt_ts = pkt->pts == AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
@@ -2703,8 +5852,10 @@ static int read_thread(void *arg)
  fail:
     if (ic && !is->ic)
         avformat_close_input(&ic);
+    av_dict_free(&open_opts);
 
     av_packet_free(&pkt);
+    bench_stage_done(is, BENCH_STAGE_READ);
     if (ret != 0) {
         SDL_Event event;
 
@@ -2712,7 +5863,6 @@ static int read_thread(void *arg)
         event.user.data1 = is;
         SDL_PushEvent(&event);
     }
-    SDL_DestroyMutex(wait_mutex);
     return 0;
 }
 
@@ -2735,28 +5885,33 @@ static VideoState *stream_open(const char *filename,
     is->iformat = iformat;
     is->ytop    = 0;
     is->xleft   = 0;
+    is->present_target = NAN;
+    is->audio_tempo = 1.0;
+    is->speed = 1.0;
+    is->tempo_out_origin = NAN;
+    is->live_tempo = 1.0;
+    is->live_newest_ts = NAN;
+    is->live_g2g = NAN;
 
     /* start video display */
-    if (frame_queue_init(&is->pictq, &is->videoq, VIDEO_PICTURE_QUEUE_SIZE, 1) < 0)
+    if (frame_queue_init(&is->pictq, &is->videoq, video_picture_queue_size, 1) < 0)
         goto fail;
-    if (frame_queue_init(&is->subpq, &is->subtitleq, SUBPICTURE_QUEUE_SIZE, 0) < 0)
+    if (frame_queue_init(&is->subpq, &is->subtitleq, subpicture_queue_size, 0) < 0)
         goto fail;
-    if (frame_queue_init(&is->sampq, &is->audioq, SAMPLE_QUEUE_SIZE, 1) < 0)
+    if (frame_queue_init(&is->sampq, &is->audioq, sample_queue_size, 1) < 0)
         goto fail;
 
-    if (packet_queue_init(&is->videoq) < 0 ||
-        packet_queue_init(&is->audioq) < 0 ||
-        packet_queue_init(&is->subtitleq) < 0)
+    if (read_wakeup_init(&is->continue_read_thread) < 0)
         goto fail;
 
-    if (!(is->continue_read_thread = SDL_CreateCond())) {
-        av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
+    if (packet_queue_init(&is->videoq, &is->continue_read_thread) < 0 ||
+        packet_queue_init(&is->audioq, &is->continue_read_thread) < 0 ||
+        packet_queue_init(&is->subtitleq, &is->continue_read_thread) < 0)
         goto fail;
-    }
 
     init_clock(&is->vidclk, &is->videoq.serial);
     init_clock(&is->audclk, &is->audioq.serial);
-    init_clock(&is->extclk, &is->extclk.serial);
+    init_clock(&is->extclk, NULL);
     is->audio_clock_serial = -1;
     if (startup_volume < 0)
         av_log(NULL, AV_LOG_WARNING, "-volume=%d < 0, setting to 0\n", startup_volume);
@@ -2766,6 +5921,7 @@ static VideoState *stream_open(const char *filename,
     startup_volume = av_clip(SDL_MIX_MAXVOLUME * startup_volume / 100, 0, SDL_MIX_MAXVOLUME);
     is->audio_volume = startup_volume;
     is->muted = 0;
+    is->audio_gain = is->audio_volume / (float)SDL_MIX_MAXVOLUME;
     is->av_sync_type = av_sync_type;
     is->read_tid     = SDL_CreateThread(read_thread, "read_thread", is);
     if (!is->read_tid) {
@@ -2863,24 +6019,31 @@ static void stream_cycle_channel(VideoState *is, int codec_type)
 
 static Frame *frame_queue_peek(FrameQueue *f)
 {
-    return &f->queue[(f->rindex + f->rindex_shown) % f->max_size];
+    return &f->queue[(f->rindex + f->rindex_shown) & (f->capacity - 1)];
 }
 
 static Frame *frame_queue_peek_next(FrameQueue *f)
 {
-    return &f->queue[(f->rindex + f->rindex_shown + 1) % f->max_size];
+    return &f->queue[(f->rindex + f->rindex_shown + 1) & (f->capacity - 1)];
 }
 
 static Frame *frame_queue_peek_last(FrameQueue *f)
 {
-    return &f->queue[f->rindex];
+    return &f->queue[f->rindex & (f->capacity - 1)];
+}
+
+/* the i-th frame counting from the last shown one, i must be lower than
+   rindex_shown + frame_queue_nb_remaining() */
+static Frame *frame_queue_peek_at(FrameQueue *f, int i)
+{
+    return &f->queue[(f->rindex + i) & (f->capacity - 1)];
 }
 
 
 /* return last shown position */
 static int64_t frame_queue_last_pos(FrameQueue *f)
 {
-    Frame *fp = &f->queue[f->rindex];
+    Frame *fp = &f->queue[f->rindex & (f->capacity - 1)];
     if (f->rindex_shown && fp->serial == f->pktq->serial)
         return fp->pos;
     else
@@ -2900,11 +6063,16 @@ static int video_open(VideoState *is)
         window_title = input_filename;
     SDL_SetWindowTitle(window, window_title);
 
+#ifdef BUILD_AS_GUI
+    /* the picture goes to the GUI's video view, the window keeps its size */
+    SDL_GetWindowSize(window, &w, &h);
+#else
     SDL_SetWindowSize(window, w, h);
     SDL_SetWindowPosition(window, screen_left, screen_top);
     if (is_full_screen)
         SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
     SDL_ShowWindow(window);
+#endif
 
     is->width  = w;
     is->height = h;
@@ -2941,7 +6109,8 @@ static void set_sdl_yuv_conversion_mode(AVFrame *frame)
 {
 #if SDL_VERSION_ATLEAST(2,0,8)
     SDL_YUV_CONVERSION_MODE mode = SDL_YUV_CONVERSION_AUTOMATIC;
-    if (frame && (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUYV422 || frame->format == AV_PIX_FMT_UYVY422)) {
+    if (frame && (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUYV422 || frame->format == AV_PIX_FMT_UYVY422 ||
+                  frame->format == AV_PIX_FMT_NV12 || frame->format == AV_PIX_FMT_NV21 || frame->format == AV_PIX_FMT_P010)) {
         if (frame->color_range == AVCOL_RANGE_JPEG)
             mode = SDL_YUV_CONVERSION_JPEG;
         else if (frame->colorspace == AVCOL_SPC_BT709)
@@ -2973,6 +6142,47 @@ static void get_sdl_pix_fmt_and_blendmode(int format, Uint32 *sdl_pix_fmt, SDL_B
 }
 
 
+/* P010 keeps its samples in the 10 most significant bits of each 16-bit word,
+   so its high bytes form an NV12 picture that can be written straight into the
+   locked texture */
+static int upload_texture_p010(SDL_Texture *tex, AVFrame *frame)
+{
+    int chroma_h = AV_CEIL_RSHIFT(frame->height, 1);
+    int row_w[2] = { frame->width, AV_CEIL_RSHIFT(frame->width, 1) * 2 };
+    int rows[2]  = { frame->height, chroma_h };
+    uint8_t *pixels;
+    int pitch, p, x, y;
+
+    if ((frame->linesize[0] < 0) != (frame->linesize[1] < 0)) {
+        av_log(NULL, AV_LOG_ERROR, "Mixed negative and positive linesizes are not supported.\n");
+        return -1;
+    }
+    if (SDL_LockTexture(tex, NULL, (void **)&pixels, &pitch) < 0)
+        return -1;
+    for (p = 0; p < 2; p++) {
+        const uint8_t *src = frame->data[p];
+        int linesize = frame->linesize[p];
+        uint8_t *dst = pixels + (p ? pitch * frame->height : 0);
+
+        /* like SDL_UpdateTexture() below, store bottom-up frames as is and let
+           the renderer flip them */
+        if (linesize < 0) {
+            src += linesize * (rows[p] - 1);
+            linesize = -linesize;
+        }
+        for (y = 0; y < rows[p]; y++) {
+            const uint16_t *s = (const uint16_t *)src;
+            for (x = 0; x < row_w[p]; x++)
+                dst[x] = s[x] >> 8;
+            src += linesize;
+            dst += pitch;
+        }
+    }
+    SDL_UnlockTexture(tex);
+    return 0;
+}
+
+
 static int upload_texture(SDL_Texture **tex, AVFrame *frame)
 {
     int ret = 0;
@@ -2996,6 +6206,23 @@ static int upload_texture(SDL_Texture **tex, AVFrame *frame)
                 return -1;
             }
             break;
+#if SDL_VERSION_ATLEAST(2,0,16)
+        case SDL_PIXELFORMAT_NV12:
+        case SDL_PIXELFORMAT_NV21:
+            if (frame->format == AV_PIX_FMT_P010) {
+                ret = upload_texture_p010(*tex, frame);
+            } else if (frame->linesize[0] > 0 && frame->linesize[1] > 0) {
+                ret = SDL_UpdateNVTexture(*tex, NULL, frame->data[0], frame->linesize[0],
+                                                      frame->data[1], frame->linesize[1]);
+            } else if (frame->linesize[0] < 0 && frame->linesize[1] < 0) {
+                ret = SDL_UpdateNVTexture(*tex, NULL, frame->data[0] + frame->linesize[0] * (frame->height                    - 1), -frame->linesize[0],
+                                                      frame->data[1] + frame->linesize[1] * (AV_CEIL_RSHIFT(frame->height, 1) - 1), -frame->linesize[1]);
+            } else {
+                av_log(NULL, AV_LOG_ERROR, "Mixed negative and positive linesizes are not supported.\n");
+                return -1;
+            }
+            break;
+#endif
         default:
             if (frame->linesize[0] < 0) {
                 ret = SDL_UpdateTexture(*tex, NULL, frame->data[0] + frame->linesize[0] * (frame->height - 1), -frame->linesize[0]);
@@ -3008,6 +6235,77 @@ static int upload_texture(SDL_Texture **tex, AVFrame *frame)
 }
 
 
+/* upload a queued picture into a texture of the ring no other queued picture
+   holds. When there is none, the picture furthest ahead gives up its texture
+   if evict is set (it is uploaded again later), else AVERROR(EAGAIN). */
+static int upload_frame(VideoState *is, Frame *vp, int evict)
+{
+    FrameQueue *f = &is->pictq;
+    int n = f->rindex_shown + frame_queue_nb_remaining(f);
+    unsigned used = 0;
+    int64_t start, trace;
+    int i, ret;
+
+    for (i = 0; i < n; i++) {
+        Frame *qp = frame_queue_peek_at(f, i);
+        if (qp->uploaded)
+            used |= 1U << qp->texture;
+    }
+    for (i = 0; i < VIDEO_TEXTURE_RING && (used & (1U << i)); i++)
+        ;
+    if (i == VIDEO_TEXTURE_RING && evict) {
+        int j;
+
+        for (j = n - 1; j >= 0; j--) {
+            Frame *qp = frame_queue_peek_at(f, j);
+            if (qp != vp && qp->uploaded) {
+                qp->uploaded = 0;
+                i = qp->texture;
+                break;
+            }
+        }
+    }
+    if (i == VIDEO_TEXTURE_RING)
+        return AVERROR(EAGAIN);
+
+    /* renderers without YUV textures convert when uploading */
+    set_sdl_yuv_conversion_mode(vp->frame);
+    start = av_gettime_relative();
+    trace = trace_begin();
+    ret = upload_texture(&is->vid_textures[i], vp->frame);
+    trace_end("upload_texture", trace);
+    set_sdl_yuv_conversion_mode(NULL);
+    if (ret < 0)
+        return ret;
+    is->upload_time = (av_gettime_relative() - start) / 1000000.0;
+    is->upload_time_sum += is->upload_time;
+    is->upload_nb++;
+
+    vp->texture = i;
+    vp->uploaded = 1;
+    vp->flip_v = vp->frame->linesize[0] < 0;
+    return 0;
+}
+
+/* upload the queued pictures while the refresh loop has nothing else to do, so
+   that displaying them is only a copy and a present */
+static void video_upload_ahead(VideoState *is)
+{
+    int i, n;
+
+    if (display_disable || !is->video_st || is->show_mode != VideoState::SHOW_MODE_VIDEO)
+        return;
+    n = frame_queue_nb_remaining(&is->pictq);
+    for (i = 0; i < n; i++) {
+        Frame *vp = frame_queue_peek_at(&is->pictq, is->pictq.rindex_shown + i);
+        if (vp->uploaded)
+            continue;
+        if (upload_frame(is, vp, 0) < 0)
+            break;
+        is->upload_ahead_nb++;
+    }
+}
+
 static void video_image_display(VideoState *is)
 {
     Frame *vp;
@@ -3065,19 +6363,20 @@ static void video_image_display(VideoState *is)
         }
     }
 
+    /* normally done by video_upload_ahead() already */
+    if (!vp->uploaded && upload_frame(is, vp, 1) < 0)
+        return;
+
     calculate_display_rect(&rect, is->xleft, is->ytop, is->width, is->height, vp->width, vp->height, vp->sar);
     set_sdl_yuv_conversion_mode(vp->frame);
 
-    if (!vp->uploaded) {
-        if (upload_texture(&is->vid_texture, vp->frame) < 0) {
-            set_sdl_yuv_conversion_mode(NULL);
-            return;
-        }
-        vp->uploaded = 1;
-        vp->flip_v = vp->frame->linesize[0] < 0;
-    }
-
-    SDL_RenderCopyEx(renderer, is->vid_texture, NULL, &rect, 0, NULL, static_cast<SDL_RendererFlip>(vp->flip_v ? SDL_FLIP_VERTICAL : 0));
+#ifdef BUILD_AS_GUI
+    /* gui_video_view() draws the textures, with the frame's YUV conversion */
+    set_sdl_yuv_conversion_mode(NULL);
+    is->sub_shown = sp != NULL;
+    return;
+#endif
+    SDL_RenderCopyEx(renderer, is->vid_textures[vp->texture], NULL, &rect, 0, NULL, static_cast<SDL_RendererFlip>(vp->flip_v ? SDL_FLIP_VERTICAL : 0));
     set_sdl_yuv_conversion_mode(NULL);
     if (sp) {
 #if USE_ONEPASS_SUBTITLE_RENDER
@@ -3151,16 +6450,16 @@ static void video_audio_display(VideoState *s)
 
         i_start= x = compute_mod(s->sample_array_index - delay * channels, SAMPLE_ARRAY_SIZE);
         if (s->show_mode == VideoState::SHOW_MODE_WAVES) {
-            h = INT_MIN;
+            float best = -INFINITY;
             for (i = 0; i < 1000; i += channels) {
                 int idx = (SAMPLE_ARRAY_SIZE + x - i) % SAMPLE_ARRAY_SIZE;
-                int a = s->sample_array[idx];
-                int b = s->sample_array[(idx + 4 * channels) % SAMPLE_ARRAY_SIZE];
-                int c = s->sample_array[(idx + 5 * channels) % SAMPLE_ARRAY_SIZE];
-                int d = s->sample_array[(idx + 9 * channels) % SAMPLE_ARRAY_SIZE];
-                int score = a - d;
-                if (h < score && (b ^ c) < 0) {
-                    h = score;
+                float a = s->sample_array[idx];
+                float b = s->sample_array[(idx + 4 * channels) % SAMPLE_ARRAY_SIZE];
+                float c = s->sample_array[(idx + 5 * channels) % SAMPLE_ARRAY_SIZE];
+                float d = s->sample_array[(idx + 9 * channels) % SAMPLE_ARRAY_SIZE];
+                float score = a - d;
+                if (best < score && (b < 0) != (c < 0)) {
+                    best = score;
                     i_start = idx;
                 }
             }
@@ -3182,7 +6481,7 @@ static void video_audio_display(VideoState *s)
             i = i_start + ch;
             y1 = s->ytop + ch * h + (h / 2); /* position of center line */
             for (x = 0; x < s->width; x++) {
-                y = (s->sample_array[i] * h2) >> 15;
+                y = av_clipf(s->sample_array[i], -1.0f, 1.0f) * h2;
                 if (y < 0) {
                     y = -y;
                     ys = y1 - y;
@@ -3236,7 +6535,7 @@ static void video_audio_display(VideoState *s)
                 i = i_start + ch;
                 for (x = 0; x < 2 * nb_freq; x++) {
                     double w = (x-nb_freq) * (1.0 / nb_freq);
-                    data_in[ch][x] = s->sample_array[i] * (1.0 - w * w);
+                    data_in[ch][x] = s->sample_array[i] * 32768.0f * (1.0 - w * w);
                     i += channels;
                     if (i >= SAMPLE_ARRAY_SIZE)
                         i -= SAMPLE_ARRAY_SIZE;
@@ -3271,19 +6570,50 @@ static void video_audio_display(VideoState *s)
 
 
 
-/* display the current picture, if any */
+/* present the back buffer and account for how far from its target time the
+   picture being presented lands */
+static void video_present(VideoState *is)
+{
+    int64_t start = av_gettime_relative();
+    int64_t trace = trace_begin();
+
+    SDL_RenderPresent(renderer);
+    trace_end("SDL_RenderPresent", trace);
+    is->present_time = (av_gettime_relative() - start) / 1000000.0;
+    is->present_time_sum += is->present_time;
+    is->present_nb++;
+
+    if (!isnan(is->present_target)) {
+        double jitter = fabs(av_gettime_relative() / 1000000.0 - is->present_target);
+        double coef = exp(log(0.01) / PRESENT_JITTER_AVG_NB);
+
+        is->present_jitter_avg = is->present_jitter_nb ? coef * is->present_jitter_avg + (1.0 - coef) * jitter : jitter;
+        is->present_jitter_max = FFMAX(is->present_jitter_max, jitter);
+        is->present_jitter_last = jitter;
+        is->present_jitter_sum += jitter;
+        is->present_jitter_nb++;
+        is->present_target = NAN;
+    }
+}
+
+/* display the current picture, if any. In GUI builds the textures are only
+   brought up to date, the GUI loop draws them and presents. */
 static void video_display(VideoState *is)
 {
     if (!is->width)
         video_open(is);
 
+#ifndef BUILD_AS_GUI
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
+#endif
     if (is->audio_st && is->show_mode != VideoState::SHOW_MODE_VIDEO)
         video_audio_display(is);
     else if (is->video_st)
         video_image_display(is);
-    SDL_RenderPresent(renderer);
+#ifndef BUILD_AS_GUI
+    video_present(is);
+#endif
 }
 
 
@@ -3350,6 +6680,8 @@ static void video_refresh(void *opaque, double *remaining_time)
 
     if (!is->paused && get_master_sync_type(is) == AV_SYNC_EXTERNAL_CLOCK && is->realtime)
         check_external_clock_speed(is);
+    if (!is->paused && is->live)
+        live_update(is);
 
     if (!display_disable && is->show_mode != VideoState::SHOW_MODE_VIDEO && is->audio_st) {
         time = av_gettime_relative() / 1000000.0;
@@ -3383,28 +6715,30 @@ retry:
             if (is->paused)
                 goto display;
 
-            /* compute nominal last_duration */
+            /* compute nominal last_duration, the delay is in stream time until
+               divided by the playback rate */
             last_duration = vp_duration(is, lastvp, vp);
-            delay = compute_target_delay(last_duration, is);
+            delay = compute_target_delay(last_duration, is) / is->speed.load(std::memory_order_relaxed);
 
+            /* a vsynced present blocks until the next vblank, so submit the
+               picture half a refresh early to land on the closest one */
             time= av_gettime_relative()/1000000.0;
-            if (time < is->frame_timer + delay) {
-                *remaining_time = FFMIN(is->frame_timer + delay - time, *remaining_time);
+            if (time + vsync_period / 2 < is->frame_timer + delay) {
+                *remaining_time = FFMIN(is->frame_timer + delay - vsync_period / 2 - time, *remaining_time);
                 goto display;
             }
 
             is->frame_timer += delay;
+            is->present_target = is->frame_timer;
             if (delay > 0 && time - is->frame_timer > AV_SYNC_THRESHOLD_MAX)
                 is->frame_timer = time;
 
-            SDL_LockMutex(is->pictq.mutex);
             if (!isnan(vp->pts))
                 update_video_pts(is, vp->pts, vp->serial);
-            SDL_UnlockMutex(is->pictq.mutex);
 
             if (frame_queue_nb_remaining(&is->pictq) > 1) {
                 Frame *nextvp = frame_queue_peek_next(&is->pictq);
-                duration = vp_duration(is, vp, nextvp);
+                duration = vp_duration(is, vp, nextvp) / is->speed.load(std::memory_order_relaxed);
                 if(!is->step && (framedrop>0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER)) && time > is->frame_timer + duration){
                     is->frame_drops_late++;
                     frame_queue_next(&is->pictq);
@@ -3463,6 +6797,7 @@ display:
         static int64_t last_time;
         int64_t cur_time;
         int aqsize, vqsize, sqsize;
+        int pqnb, sqnb;
         double av_diff;
 
         cur_time = av_gettime_relative();
@@ -3476,6 +6811,8 @@ display:
                 vqsize = is->videoq.size;
             if (is->subtitle_st)
                 sqsize = is->subtitleq.size;
+            pqnb = is->video_st ? frame_queue_nb_remaining(&is->pictq) : 0;
+            sqnb = is->audio_st ? frame_queue_nb_remaining(&is->sampq) : 0;
             av_diff = 0;
             if (is->audio_st && is->video_st)
                 av_diff = get_clock(&is->audclk) - get_clock(&is->vidclk);
@@ -3486,14 +6823,25 @@ display:
 
             av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
             av_bprintf(&buf,
-                      "%7.2f %s:%7.3f fd=%4d aq=%5dKB vq=%5dKB sq=%5dB \r",
+                      "%7.2f %s:%7.3f fd=%4d aq=%5dKB vq=%5dKB sq=%5dB pf=%3d/%-3d af=%3d/%-3d au=%3d pj=%5.2fms ",
                       get_master_clock(is),
                       (is->audio_st && is->video_st) ? "A-V" : (is->video_st ? "M-V" : (is->audio_st ? "M-A" : "   ")),
                       av_diff,
                       is->frame_drops_early + is->frame_drops_late,
                       aqsize / 1024,
                       vqsize / 1024,
-                      sqsize);
+                      sqsize,
+                      pqnb, is->pictq.max_size,
+                      sqnb, is->sampq.max_size,
+                      is->audio_underruns,
+                      is->present_jitter_avg * 1000.0);
+            if (is->speed.load(std::memory_order_relaxed) != 1.0)
+                av_bprintf(&buf, "x%.2f ", is->speed.load(std::memory_order_relaxed));
+            if (is->degrade.level)
+                av_bprintf(&buf, "dg=%d ", is->degrade.level);
+            if (is->live)
+                av_bprintf(&buf, "ll=%4.0f/%-4.0fms tempo=%.3f ", is->live_buffered * 1000.0, is->live_target * 1000.0, is->audio_tempo);
+            av_bprintf(&buf, "\r");
 
             if (show_status == 1 && AV_LOG_INFO > av_log_get_level())
                 fprintf(stderr, "%s", buf.str);
@@ -3538,12 +6886,41 @@ static void seek_chapter(VideoState *is, int incr)
                                  AV_TIME_BASE_Q), 0, 0);
 }
 
+/* switch between forward and reverse playback at the picture on screen; both
+   directions restart demuxing there so that the queued pictures are dropped */
+static void toggle_reverse(VideoState *is)
+{
+    double pos;
+
+    if (!is->video_st || (is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC) ||
+        !is->pictq.rindex_shown || gop_cache_size <= 0)
+        return;
+    pos = frame_queue_peek_last(&is->pictq)->pts;
+    if (isnan(pos))
+        return;
+    if (!is->gop_cache &&
+        gop_cache_open(&is->gop_cache, is->filename, is->iformat, is->video_stream,
+                       video_codec_name, gop_cache_size * 1024LL * 1024) < 0)
+        return;
+
+    if (!is->reverse) {
+        is->reverse_pts = pos;
+        is->reverse = 1;
+    } else {
+        is->reverse = 0;
+        gop_cache_wake(is->gop_cache);
+    }
+    av_log(NULL, AV_LOG_VERBOSE, "%s playback at %0.3f\n", is->reverse ? "Reverse" : "Forward", pos);
+    stream_seek(is, (int64_t)(pos * AV_TIME_BASE), 0, 0);
+}
+
 
 static void do_exit(VideoState *is)
 {
     if (is) {
         stream_close(is);
     }
+    trace_export();
     if (renderer)
         SDL_DestroyRenderer(renderer);
     // if (vk_renderer)
@@ -3571,6 +6948,40 @@ static void sigterm_handler(int sig)
     exit(123);
 }
 
+/* Sleep for at most timeout seconds (forever if infinite), or until an SDL
+ * event arrives, return 1 and the event in that case. If no picture is
+ * queued, queue_picture() wakes us with an FF_REFRESH_EVENT. */
+static int refresh_wait_event(VideoState *is, SDL_Event *event, double timeout)
+{
+    int64_t deadline;
+    int ret = 0;
+
+    if (is->video_st && frame_queue_nb_remaining(&is->pictq) == 0) {
+        is->refresh_wanted.store(1, std::memory_order_relaxed);
+        /* either queue_picture() sees the flag or we see its picture */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (frame_queue_nb_remaining(&is->pictq) > 0) {
+            is->refresh_wanted.store(0, std::memory_order_relaxed);
+            return 0;
+        }
+    }
+
+    if (isinf(timeout)) {
+        ret = SDL_WaitEvent(event);
+    } else {
+        deadline = av_gettime_relative() + (int64_t)(timeout * 1000000.0);
+        if (timeout > REFRESH_EVENT_MARGIN)
+            ret = SDL_WaitEventTimeout(event, (int)((timeout - REFRESH_EVENT_MARGIN) * 1000.0));
+        if (!ret) {
+            int64_t left = deadline - av_gettime_relative();
+            if (left > 0)
+                av_usleep(left);
+        }
+    }
+    is->refresh_wanted.store(0, std::memory_order_relaxed);
+    return ret;
+}
+
 static void refresh_loop_wait_event(VideoState *is, SDL_Event *event) {
     double remaining_time = 0.0;
     SDL_PumpEvents();
@@ -3580,8 +6991,14 @@ static void refresh_loop_wait_event(VideoState *is, SDL_Event *event) {
             cursor_hidden = 1;
         }
         if (remaining_time > 0.0)
-            av_usleep((int64_t)(remaining_time * 1000000.0));
-        remaining_time = REFRESH_RATE;
+            video_upload_ahead(is);
+        if (remaining_time > 0.0 && refresh_wait_event(is, event, remaining_time) &&
+            event->type != FF_REFRESH_EVENT)
+            return;
+        /* while paused nothing happens until an event arrives */
+        remaining_time = is->paused ? INFINITY : REFRESH_RATE;
+        if (!cursor_hidden)
+            remaining_time = FFMIN(remaining_time, (cursor_last_shown + CURSOR_HIDE_DELAY - av_gettime_relative()) / 1000000.0);
         if (is->show_mode != VideoState::SHOW_MODE_NONE && (!is->paused || is->force_refresh))
             video_refresh(is, &remaining_time);
         SDL_PumpEvents();
@@ -3631,7 +7048,25 @@ static const OptionDef options[] = {
     { "exitonmousedown",    OPT_TYPE_BOOL,   OPT_EXPERT, { &exit_on_mousedown }, "exit on mouse down", "" },
     { "loop",               OPT_TYPE_INT,    OPT_EXPERT, { &loop }, "set number of times the playback shall be looped", "loop count" },
     { "framedrop",          OPT_TYPE_BOOL,   OPT_EXPERT, { &framedrop }, "drop frames when cpu is too slow", "" },
+    { "speed",              OPT_TYPE_FLOAT,  OPT_EXPERT, { &playback_speed }, "playback rate from 0.5 to 4, audio is time-stretched to keep its pitch", "rate" },
+    { "autodegrade",        OPT_TYPE_BOOL,   OPT_EXPERT, { &autodegrade }, "lower video decoding quality while frames are dropped, restoring it when the CPU has headroom again", "" },
+    { "live_latency",       OPT_TYPE_INT,    OPT_EXPERT, { &live_latency }, "low-latency mode for realtime inputs: keep playback this close to the live edge, catching up by time-stretching audio", "ms" },
     { "infbuf",             OPT_TYPE_BOOL,   OPT_EXPERT, { &infinite_buffer }, "don't limit the input buffer size (useful with realtime streams)", "" },
+    { "vsync",              OPT_TYPE_BOOL,   OPT_EXPERT, { &vsync }, "present pictures on the display vsync", "" },
+    { "mmap",               OPT_TYPE_BOOL,   OPT_EXPERT, { &use_mmap }, "map local input files into memory instead of reading them", "" },
+    { "accurate_seek",      OPT_TYPE_BOOL,   OPT_EXPERT, { &accurate_seek }, "resume playback exactly at the seek target instead of at the keyframe before it", "" },
+    { "kfindex",            OPT_TYPE_BOOL,   OPT_EXPERT, { &use_kf_index }, "seek through a keyframe index cached next to the input, for formats without a usable index", "" },
+    { "readahead",          OPT_TYPE_INT,    OPT_EXPERT, { &readahead_size }, "read the input through a read-ahead buffer of this size (0 = off)", "KB" },
+    { "gain_bench",         OPT_TYPE_BOOL,   OPT_EXPERT, { &gain_bench }, "time the audio gain kernels against SDL_MixAudioFormat() and exit" },
+    { "benchmark",          OPT_TYPE_BOOL,   OPT_EXPERT, { &benchmark }, "decode and filter as fast as possible without output, then report throughput and resource use", "" },
+    { "trace",              OPT_TYPE_STRING, OPT_EXPERT, { &trace_filename }, "record per-stage timing spans and write them to file as a Chrome trace on exit", "file" },
+    { "frame_pool",         OPT_TYPE_BOOL,   OPT_EXPERT, { &frame_pool }, "decode video into pooled buffers reused across frames" },
+    { "gop_cache",          OPT_TYPE_INT,    OPT_EXPERT, { &gop_cache_size }, "memory cap of the decoded GOPs kept for reverse playback, 0 disables it", "MB" },
+    { "readahead_window",   OPT_TYPE_INT,    OPT_EXPERT, { &readahead_window }, "how far ahead of the demuxer to prefetch, half the read-ahead buffer by default", "KB" },
+    { "pictq",              OPT_TYPE_INT,    OPT_EXPERT, { &video_picture_queue_size }, "number of decoded video frames to queue", "frames" },
+    { "sampq",              OPT_TYPE_INT,    OPT_EXPERT, { &sample_queue_size }, "number of decoded audio frames to queue", "frames" },
+    { "subpq",              OPT_TYPE_INT,    OPT_EXPERT, { &subpicture_queue_size }, "number of decoded subtitles to queue", "frames" },
+    { "frameq_ms",          OPT_TYPE_INT,    OPT_EXPERT, { &frame_queue_ms }, "grow the video and audio frame queues to hold this much decoded output", "msecs" },
     { "window_title",       OPT_TYPE_STRING,          0, { &window_title }, "set window title", "window title" },
     { "left",               OPT_TYPE_INT,    OPT_EXPERT, { &screen_left }, "set the x position for the left of the window", "x pos" },
     { "top",                OPT_TYPE_INT,    OPT_EXPERT, { &screen_top }, "set the y position for the top of the window", "y pos" },
@@ -3677,6 +7112,9 @@ void show_help_default(const char *opt, const char *arg)
            "c                   cycle program\n"
            "w                   cycle video filters or show modes\n"
            "s                   activate frame-step mode\n"
+           "b                   step to the previous frame\n"
+           "r                   toggle reverse playback\n"
+           "[, ]                decrease and increase playback speed respectively\n"
            "left/right          seek backward/forward 10 seconds or to custom interval if -seek_interval is set\n"
            "down/up             seek backward/forward 1 minute\n"
            "page down/page up   seek backward/forward 10 minutes\n"
@@ -3696,6 +7134,7 @@ static void event_loop(VideoState *cur_stream)
     SDL_Event event;
     double incr, pos, frac;
 
+    trace_set_thread_name("main");
     for (;;) {
         double x;
         refresh_loop_wait_event(cur_stream, &event);
@@ -3729,8 +7168,25 @@ static void event_loop(VideoState *cur_stream)
                 update_volume(cur_stream, -1, SDL_VOLUME_STEP);
                 break;
             case SDLK_s: // S: Step to next frame
+                if (cur_stream->reverse)
+                    toggle_reverse(cur_stream);
                 step_to_next_frame(cur_stream);
                 break;
+            case SDLK_b: // B: Step to previous frame
+                if (!cur_stream->reverse)
+                    toggle_reverse(cur_stream);
+                if (cur_stream->reverse)
+                    step_to_next_frame(cur_stream);
+                break;
+            case SDLK_r:
+                toggle_reverse(cur_stream);
+                break;
+            case SDLK_LEFTBRACKET:
+                step_playback_speed(cur_stream, -1);
+                break;
+            case SDLK_RIGHTBRACKET:
+                step_playback_speed(cur_stream, 1);
+                break;
             case SDLK_a:
                 stream_cycle_channel(cur_stream, AVMEDIA_TYPE_AUDIO);
                 break;
@@ -3889,6 +7345,114 @@ static void event_loop(VideoState *cur_stream)
 }
 
 
+/* run the pipeline unpaced until read_thread hits the end of the input */
+static void benchmark_loop(VideoState *is)
+{
+    SDL_Event event;
+
+    /* read_thread starts the sinks and sends FF_QUIT_EVENT at the end or on failure */
+    while (SDL_WaitEvent(&event) && event.type != FF_QUIT_EVENT)
+        ;
+    is->bench_end = av_gettime_relative();
+    stream_close(is);
+}
+
+
+#ifdef BUILD_AS_GUI
+//              ##########################################
+//                    Performance Overlay Functions
+//              ##########################################
+
+static void perf_history_sample(PerfHistory *h, VideoState *is)
+{
+    double drift = NAN;
+    float *v[PERF_NB];
+    int i;
+
+    for (i = 0; i < PERF_NB; i++)
+        v[i] = &h->values[i][h->index];
+    if (is->audio_st && is->video_st)
+        drift = get_clock(&is->audclk) - get_clock(&is->vidclk);
+
+    *v[PERF_AUDIOQ]          = is->audioq.size / 1024.0f;
+    *v[PERF_VIDEOQ]          = is->videoq.size / 1024.0f;
+    *v[PERF_SUBTITLEQ]       = is->subtitleq.size / 1024.0f;
+    *v[PERF_PICTQ]           = is->video_st ? frame_queue_nb_remaining(&is->pictq) : 0;
+    *v[PERF_SAMPQ]           = is->audio_st ? frame_queue_nb_remaining(&is->sampq) : 0;
+    *v[PERF_AV_DRIFT]        = isnan(drift) ? 0.0f : drift * 1000.0f;
+    *v[PERF_DECODE_TIME]     = is->viddec.frame_decode_time * 1000.0f;
+    *v[PERF_UPLOAD_TIME]     = is->upload_time * 1000.0f;
+    *v[PERF_PRESENT_TIME]    = is->present_time * 1000.0f;
+    *v[PERF_PRESENT_JITTER]  = is->present_jitter_last * 1000.0f;
+    *v[PERF_DROPS_EARLY]     = is->frame_drops_early - h->last_drops_early;
+    *v[PERF_DROPS_LATE]      = is->frame_drops_late - h->last_drops_late;
+    h->last_drops_early = is->frame_drops_early;
+    h->last_drops_late  = is->frame_drops_late;
+    h->index = (h->index + 1) % PERF_HISTORY_SIZE;
+}
+
+static void perf_overlay_draw(PerfHistory *h, VideoState *is)
+{
+    static const char *const names[PERF_NB] = {
+        "audioq KB", "videoq KB", "subtitleq KB", "pictq frames", "sampq frames",
+        "A-V drift ms", "decode ms", "upload ms", "present ms", "present jitter ms", "drops early", "drops late",
+    };
+    int last = (h->index + PERF_HISTORY_SIZE - 1) % PERF_HISTORY_SIZE;
+    char overlay[32];
+    int i;
+
+    ImGui::SetNextWindowPos(ImVec2(10, 10), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowBgAlpha(0.6f);
+    ImGui::Begin("Performance", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+    ImGui::Text("%s x%.2f  %.3f  %s", is->paused ? "paused" : "playing", is->speed.load(std::memory_order_relaxed), get_master_clock(is), is->filename);
+    ImGui::Text("frame drops: %d early, %d late, audio underruns: %d", is->frame_drops_early, is->frame_drops_late, is->audio_underruns);
+    if (is->degrade.level)
+        ImGui::Text("decoder degraded: level %d of %d", is->degrade.level, is->degrade.max_level);
+    if (is->viddec.catch_ups)
+        ImGui::Text("catch-up: %s, %" PRId64 " packets skipped", is->viddec.catch_up ? "active" : "idle",
+                    is->viddec.catch_up_skipped);
+    if (is->live)
+        ImGui::Text("live: %.0f/%.0f ms buffered, jitter %.1f ms, tempo %.3f, glass-to-glass %.0f ms",
+                    is->live_buffered * 1000.0, is->live_target * 1000.0, is->live_jitter.load() * 1000.0,
+                    is->audio_tempo, is->live_g2g * 1000.0);
+    for (i = 0; i < PERF_NB; i++) {
+        snprintf(overlay, sizeof(overlay), "%.2f", h->values[i][last]);
+        ImGui::PlotLines(names[i], h->values[i], PERF_HISTORY_SIZE, h->index, overlay,
+                         FLT_MAX, FLT_MAX, ImVec2(240, 36));
+    }
+    ImGui::End();
+}
+
+/* the video viewport: the picture and subtitle textures drawn by ImGui itself,
+   scaled to the window with the picture's aspect ratio */
+static void gui_video_view(VideoState *is)
+{
+    ImVec2 avail, pos;
+    SDL_Rect rect;
+    Frame *vp;
+
+    ImGui::SetNextWindowPos(ImVec2(280, 10), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(960, 560), ImGuiCond_FirstUseEver);
+    ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0, 0));
+    ImGui::Begin("Video", NULL, ImGuiWindowFlags_NoScrollbar | ImGuiWindowFlags_NoScrollWithMouse);
+    ImGui::PopStyleVar();
+    avail = ImGui::GetContentRegionAvail();
+    vp = is->video_st && is->pictq.rindex_shown ? frame_queue_peek_last(&is->pictq) : NULL;
+    if (vp && vp->uploaded && is->show_mode == VideoState::SHOW_MODE_VIDEO && avail.x >= 1 && avail.y >= 1) {
+        ImDrawList *draw_list = ImGui::GetWindowDrawList();
+
+        pos = ImGui::GetCursorScreenPos();
+        calculate_display_rect(&rect, (int)pos.x, (int)pos.y, (int)avail.x, (int)avail.y, vp->width, vp->height, vp->sar);
+        ImVec2 p0(rect.x, rect.y), p1(rect.x + rect.w, rect.y + rect.h);
+        draw_list->AddImage((ImTextureID)(intptr_t)is->vid_textures[vp->texture], p0, p1,
+                            ImVec2(0, vp->flip_v ? 1 : 0), ImVec2(1, vp->flip_v ? 0 : 1));
+        if (is->sub_shown && is->sub_texture)
+            draw_list->AddImage((ImTextureID)(intptr_t)is->sub_texture, p0, p1);
+    }
+    ImGui::End();
+}
+#endif
+
 
 // =============================================================================
 //                                 Main Loop
@@ -3918,11 +7482,55 @@ extern "C" int SDL_main(int argc, char** argv)
     ret = parse_options(NULL, argc, argv, options, opt_input_file);
     if (ret < 0)
         exit(ret == AVERROR_EXIT ? 0 : 1);
+    trace_enabled = !!trace_filename;
+    audio_gain_init();
+
+    if (gain_bench) {
+        audio_gain_benchmark();
+        return 0;
+    }
+
+    if (benchmark) {
+        if (!input_filename) {
+            av_log(NULL, AV_LOG_FATAL, "An input file must be specified\n");
+            exit(1);
+        }
+        /* no window, no audio device and nothing that waits for the clock */
+        subtitle_disable = 1;
+        framedrop = 0;
+        autoexit = 1;
+        loop = 1;
+        if (SDL_Init(SDL_INIT_EVENTS | SDL_INIT_TIMER)) {
+            av_log(NULL, AV_LOG_FATAL, "Could not initialize SDL - %s\n", SDL_GetError());
+            exit(1);
+        }
+        is = stream_open(input_filename, file_iformat);
+        if (!is) {
+            av_log(NULL, AV_LOG_FATAL, "Failed to initialize VideoState!\n");
+            SDL_Quit();
+            exit(1);
+        }
+        is->bench_start = av_gettime_relative();
+        benchmark_loop(is);
+        trace_export();
+        SDL_Quit();
+        return 0;
+    }
 
     #ifdef BUILD_AS_GUI
+        flags = SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER;
+        if (audio_disable)
+            flags &= ~SDL_INIT_AUDIO;
+        if (SDL_Init(flags)) {
+            av_log(NULL, AV_LOG_FATAL, "Could not initialize SDL - %s\n", SDL_GetError());
+            exit(1);
+        }
+        SDL_EventState(SDL_SYSWMEVENT, SDL_IGNORE);
+        SDL_EventState(SDL_USEREVENT, SDL_IGNORE);
+
         // Create window
         SDL_WindowFlags window_flags = (SDL_WindowFlags)(SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI);
-        SDL_Window* window = SDL_CreateWindow("FFplay with ImGui", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1280, 720, window_flags);
+        window = SDL_CreateWindow("FFplay with ImGui", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1280, 720, window_flags);
         if (window == NULL)
         {
             fprintf(stderr, "Error creating window: %s\n", SDL_GetError());
@@ -3930,8 +7538,8 @@ extern "C" int SDL_main(int argc, char** argv)
             return -1;
         }
 
-        // Create renderer
-        SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_ACCELERATED);
+        // Create renderer, shared by the player and ImGui
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
         if (renderer == NULL)
         {
             SDL_Log("Error creating SDL_Renderer: %s", SDL_GetError());
@@ -3939,6 +7547,14 @@ extern "C" int SDL_main(int argc, char** argv)
             SDL_Quit();
             return -1;
         }
+        if (!SDL_GetRendererInfo(renderer, &renderer_info)) {
+            av_log(NULL, AV_LOG_VERBOSE, "Initialized %s renderer.\n", renderer_info.name);
+            if (renderer_info.flags & SDL_RENDERER_PRESENTVSYNC) {
+                SDL_DisplayMode mode;
+                if (!SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) && mode.refresh_rate > 0)
+                    vsync_period = 1.0 / mode.refresh_rate;
+            }
+        }
 
         // Setup Dear ImGui context
         IMGUI_CHECKVERSION();
@@ -3953,19 +7569,68 @@ extern "C" int SDL_main(int argc, char** argv)
         ImGui_ImplSDL2_InitForSDLRenderer(window, renderer);
         ImGui_ImplSDLRenderer2_Init(renderer);
 
+        is = NULL;
+        if (input_filename && !(is = stream_open(input_filename, file_iformat)))
+            av_log(NULL, AV_LOG_FATAL, "Failed to initialize VideoState!\n");
+
         // Main loop
+        static PerfHistory perf_history;
         bool done = false;
         while (!done)
         {
+            double remaining_time = REFRESH_RATE;
+
             // Poll and handle events
             SDL_Event event;
             while (SDL_PollEvent(&event))
             {
                 ImGui_ImplSDL2_ProcessEvent(&event);
-                if (event.type == SDL_QUIT)
+                if (event.type == SDL_QUIT || event.type == FF_QUIT_EVENT)
                     done = true;
                 if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID(window))
                     done = true;
+                if (!is)
+                    continue;
+                if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    screen_width  = is->width  = event.window.data1;
+                    screen_height = is->height = event.window.data2;
+                    if (is->vis_texture) {
+                        SDL_DestroyTexture(is->vis_texture);
+                        is->vis_texture = NULL;
+                    }
+                }
+                if (event.type == SDL_KEYDOWN && !io.WantCaptureKeyboard) {
+                    switch (event.key.keysym.sym) {
+                    case SDLK_ESCAPE:
+                    case SDLK_q:
+                        done = true;
+                        break;
+                    case SDLK_p:
+                    case SDLK_SPACE:
+                        toggle_pause(is);
+                        break;
+                    case SDLK_s:
+                        step_to_next_frame(is);
+                        break;
+                    case SDLK_LEFTBRACKET:
+                        step_playback_speed(is, -1);
+                        break;
+                    case SDLK_RIGHTBRACKET:
+                        step_playback_speed(is, 1);
+                        break;
+                    default:
+                        break;
+                    }
+                }
+            }
+
+            // Bring the player's textures up to date, audio visualizations
+            // are drawn straight into the back buffer
+            SDL_SetRenderDrawColor(renderer, (Uint8)(0.45f * 255), (Uint8)(0.55f * 255), (Uint8)(0.60f * 255), (Uint8)(255));
+            SDL_RenderClear(renderer);
+            if (is) {
+                is->force_refresh = 1;
+                video_refresh(is, &remaining_time);
             }
 
             // Start the Dear ImGui frame
@@ -3973,26 +7638,37 @@ extern "C" int SDL_main(int argc, char** argv)
             ImGui_ImplSDL2_NewFrame();
             ImGui::NewFrame();
 
-            // Your ImGui windows and controls go here
-            ImGui::Begin("FFplay Controls");
-            ImGui::Text("Add your controls here");
-            ImGui::End();
+            if (is) {
+                gui_video_view(is);
+                perf_history_sample(&perf_history, is);
+                perf_overlay_draw(&perf_history, is);
+            } else {
+                ImGui::Begin("FFplay Controls");
+                ImGui::Text("No input, pass a file on the command line");
+                ImGui::End();
+            }
 
-            // Rendering
+            // Rendering: one present per refresh for the picture and the controls
             ImGui::Render();
-            SDL_RenderSetScale(renderer, io.DisplayFramebufferScale.x, io.DisplayFramebufferScale.y);
-            SDL_SetRenderDrawColor(renderer, (Uint8)(0.45f * 255), (Uint8)(0.55f * 255), (Uint8)(0.60f * 255), (Uint8)(255));
-            SDL_RenderClear(renderer);
+            if (is && is->video_st && is->pictq.rindex_shown)
+                set_sdl_yuv_conversion_mode(frame_queue_peek_last(&is->pictq)->frame);
             ImGui_ImplSDLRenderer2_RenderDrawData(ImGui::GetDrawData(), renderer);
-            SDL_RenderPresent(renderer);
+            set_sdl_yuv_conversion_mode(NULL);
+            if (is) {
+                video_present(is);
+                video_upload_ahead(is);
+            } else
+                SDL_RenderPresent(renderer);
+            /* without vsync nothing paces the loop */
+            if (!vsync_period)
+                av_usleep((int64_t)(FFMIN(remaining_time, REFRESH_RATE) * 1000000.0));
         }
 
         // Cleanup
         ImGui_ImplSDLRenderer2_Shutdown();
         ImGui_ImplSDL2_Shutdown();
         ImGui::DestroyContext();
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
+        do_exit(is);
     #else
 
         // if (!input_filename) {
@@ -4051,7 +7727,7 @@ extern "C" int SDL_main(int argc, char** argv)
             return -1;
         }
 
-        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
 
         if (!renderer) {
             av_log(NULL, AV_LOG_WARNING, "Failed to initialize a hardware accelerated renderer: %s\n", SDL_GetError());
@@ -4060,6 +7736,11 @@ extern "C" int SDL_main(int argc, char** argv)
         if (renderer) {
             if (!SDL_GetRendererInfo(renderer, &renderer_info))
                 av_log(NULL, AV_LOG_VERBOSE, "Initialized %s renderer.\n", renderer_info.name);
+            if (renderer_info.flags & SDL_RENDERER_PRESENTVSYNC) {
+                SDL_DisplayMode mode;
+                if (!SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) && mode.refresh_rate > 0)
+                    vsync_period = 1.0 / mode.refresh_rate;
+            }
         }
         if (!renderer || !renderer_info.num_texture_formats) {
             av_log(NULL, AV_LOG_FATAL, "Failed to create window or renderer: %s", SDL_GetError());